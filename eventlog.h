@@ -0,0 +1,44 @@
+#ifndef EVENTLOG_H
+#define EVENTLOG_H
+
+/*Binary race log. The file is a LogHeader followed by RaceEvent records, in the order the events happened.
+Both are written in the byte order of the machine that ran the race. racelog renders the text log (output/race.log) from it*/
+
+#include <stdint.h>
+
+#define LOG_MAGIC        "RACELOG"   /*Magic string at the beginning of a binary log*/
+#define LOG_VERSION      2
+
+/*Types of events*/
+#define EVENT_LAP         1          /*cyclist completed a lap. lap is his new lap*/
+#define EVENT_LOSER       2          /*cyclist crossed the line in one of the last 3 places. slot is 1, 2 or 3 (3 is the last place)*/
+#define EVENT_ELIMINATION 3          /*cyclist was eliminated (last across the line, or caught in a pursuit)*/
+#define EVENT_BREAK       4          /*cyclist broke. place is his final standing*/
+#define EVENT_OVERTAKE    5          /*cyclist overtook other. place is his new place*/
+#define EVENT_WINNERS     6          /*End of the race. cyclist, other and third are the 1st, 2nd and 3rd places*/
+
+/*Header of a binary log*/
+typedef struct log_header {
+   char magic[8];                    /*LOG_MAGIC*/
+   int32_t version;                  /*LOG_VERSION*/
+   int32_t mode;                     /*Simulation mode (u, v, U or V)*/
+   int32_t total_cyclists;           /*Number of cyclists at the start of the race*/
+   int32_t track_size;               /*Size of the track, in meters*/
+   int32_t rules;                    /*Rule set of the race (see rules.h)*/
+   int32_t pad;
+} LogHeader;
+
+/*An event of the race. Cyclists are recorded by their numbers*/
+typedef struct race_event {
+   uint16_t type;                    /*EVENT_* type*/
+   uint16_t slot;                    /*EVENT_LOSER only*/
+   uint32_t tick;                    /*Simulation cycle of the event*/
+   int32_t cyclist;                  /*Cyclist number*/
+   int32_t other;                    /*Overtaken cyclist, or 2nd place (EVENT_WINNERS)*/
+   int32_t third;                    /*3rd place (EVENT_WINNERS)*/
+   int32_t lap;                      /*Lap of the cyclist*/
+   int32_t place;                    /*Place of the cyclist*/
+   int32_t competing;                /*Cyclists competing when the event happened*/
+} RaceEvent;
+
+#endif
@@ -1,80 +1,659 @@
-#define _XOPEN_SOURCE 500 /*To compile without nanosleep implicit declaration warning*/
+#define _XOPEN_SOURCE 600 /*To compile without nanosleep and pthread_barrier implicit declaration warnings*/
+#define _DEFAULT_SOURCE    /*For MAP_ANONYMOUS and MADV_HUGEPAGE*/
 
 #include <pthread.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <strings.h>
 #include <time.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "eventlog.h"
+#include "trace.h"
+#include "rules.h"
+#include "telemetry.h"
 
 #define MINIMUM_CYCLISTS 3
 #define MINIMUM_METERS   249
+#define MAXIMUM_METERS   (INT_MAX / POSITION_UNITS) /*Longest track whose positions fit in an int*/
 #define EXPECTED_ARGS    4
 #define START            1
 #define STOP             0
 #define MAX_CYCLISTS     4
 #define NO_CYCLISTS      0
+#define FULL             ((1u << MAX_CYCLISTS) - 1) /*Occupancy of a meter with all fields taken*/
+#define THREAD_ENGINE    't'
+#define LOCKSTEP_ENGINE  'l'
+#define SEGMENT_ENGINE   's'
+#define CRUISE_ENGINE    'c'
+#define CYCLE_NSEC       72000000 /*Duration of a simulation cycle (a tick), in nanoseconds*/
+#define EVENT_RING_SIZE  65536    /*Events the event ring holds. Must be a power of 2*/
+#define EVENT_BATCH      4096     /*Events the logger writes at once*/
+#define EMPTY            -1       /*No cyclist*/
+#define FREE_FIELD       0        /*Empty cyclist field of a meter. Fields hold the cyclist plus 1, so a zeroed meter is empty*/
+#define ELIMINATED       0x1      /*Status bit: is he eliminated?*/
+#define BROKEN           0x2      /*Status bit: did he broke?*/
+#define CAUGHT           0x4      /*Status bit: was he caught (pursuit)? He is eliminated in his next move*/
+#define OUT              (ELIMINATED | BROKEN)
+#define BENCH_MOVES      20000000  /*Default number of moves after which a benchmark race is stopped*/
+#define BENCH_SEED       1
+#define SNAPSHOT_FILE    "output/race.snap"
+#define SNAPSHOT_MAGIC   "RACESNP"  /*Magic string at the beginning of a snapshot*/
+#define SNAPSHOT_VERSION 5
+#define SNAPSHOT_NAP_NSEC 1000000  /*Time the snapshot writer waits for the logger to catch up*/
+#define TRACE_FILE       "output/race.trace"
+#define KEYFRAME_EVERY   256      /*Frames of the trace from a keyframe to the next*/
+#define TRACE_WINDOW     (16 << 20) /*Bytes of the trace mapped at once*/
+#define VARINT_BYTES     5        /*Longest varint of a 32 bit number*/
+#define DEBUG_EVERY      20       /*Default cycles between two debug frames*/
+#define ARENA_ALIGN      64       /*Alignment of the arena allocations (a cache line)*/
+#define HUGE_PAGE        (2 << 20) /*Alignment of the arena*/
+#define ARENA_ROUND(n)   (((n) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+#define MIN(a, b)        ((a) < (b) ? (a) : (b))
+#define DEBUGGING        ((mode == 'U' || mode == 'V') && !quiet) /*Are debug frames shown?*/
+#if FINISH_LAPS
+#define RACE_OVER        (cyclists_competing() == 1 || __atomic_load_n(&race.finished, __ATOMIC_ACQUIRE)) /*Is the race over?*/
+#else
+#define RACE_OVER        (cyclists_competing() == 1)
+#endif
+#if SPREAD_START
+#define START_METER(i)   ((int)((long)track_size * (i) / total_cyclists)) /*Meter where the cyclist i starts*/
+#define HEAD_START(i)    START_METER(i) /*Meters the cyclist i starts ahead of the line, not counted in his distance*/
+#else
+#define START_METER(i)   (i)
+#define HEAD_START(i)    0
+#endif
+#define ROW_BYTES        128      /*Longest line of a cyclist in a debug frame*/
+#define GRID_STREAM      0        /*Random stream of the starting grid. The stream of the cyclist i is i+1*/
+#define RANDOM_GRID      'r'
+#define RANKED_GRID      'k'
+#define HEATS_GRID       'h'
+#define HEAT_SIZE        8        /*Default cyclists in a heat of the starting grid*/
+#define TELEMETRY_SUBSCRIBERS 8   /*Most subscribers of the telemetry at once*/
+#define TELEMETRY_LINGER 1        /*Seconds the end of the race waits for each subscriber to take its last frames*/
+#define SERVER_CLIENTS   16       /*Most clients of the server at once*/
+#define SPARSE_SLOTS     4        /*Slots of the sparse track per cyclist, at least*/
+#define MIN_SLOTS        64
+#define CRUISE_EVENTS    4096     /*Most events of a window of the cruise engine that a leap repeats (see leap())*/
+#define CRUISE_STRETCH   64       /*Most periods of the velocities in a window of the cruise engine*/
+#define METER_HASH       2654435761u /*Multiplier of the hash of a meter number (Knuth)*/
+#define SPEC_BYTES       256      /*Longest line of a client (a race)*/
+#define RESULT_BYTES     256      /*Longest line of a result*/
 
-/*struct containing the attributes of a cyclist*/
-typedef struct cyclist { 
-   int number;                /*Cyclist number*/
-   int position;              /*Position in the track. [0...track_size-1]. Position is printed as*/
-   int place;                 /*His place of the race (1 for first, 2 for second... cyclist_competing for last (in actual lap))*/
-   int speed;                 /*Cyclist speed. 25km/h or 50km/h*/
-   int lap;                   /*His actual lap*/
-   char eliminated;           /*is he eliminated?*/
-   char broken;               /*did he broke?*/
-   clock_t cyclist_timer;     /*Elimination, broken or victory time*/
-   float half;                /*Stores extra position for speed = 25*/
-} Cyclist;
-
-/*Each position of the track is a cell of type meter*/
+/*Instrumentation (make race-instrumented). Every thread counts how often it goes through each synchronization point (a probe), 
+how often it had to wait there and for how long. The probes are compiled out unless INSTRUMENT is defined*/
+#ifdef INSTRUMENT
+#define PROBE_FIELD_WAIT   0        /*Waits for a free field of a full meter (thread engine)*/
+#define PROBE_STANDINGS    1        /*standings.lock*/
+#define PROBE_BARRIER      2        /*tick_barrier (lockstep and segment engines)*/
+#define PROBE_LOGGER_SLEEP 3        /*Sleeps of the logger waiting for events*/
+#define PROBE_RING_FULL    4        /*Waits for room in the event ring*/
+#define PROBES             5
+#define HISTOGRAM_BUCKETS  32       /*Bucket b of a histogram counts the values in [2^b...2^(b+1)-1] (bucket 0 also counts 0)*/
+#define LOCK(lock, probe)        probed_lock(lock, probe)
+#define BARRIER_WAIT(barrier)    probed_barrier_wait(barrier)
+#define PROBE_BEGIN(probe)       probe_begin(probe)
+#define PROBE_END(probe)         probe_end(probe)
+#define COUNT_MOVES(n)           count_moves(n)
+#else
+#define LOCK(lock, probe)        pthread_mutex_lock(lock)
+#define BARRIER_WAIT(barrier)    pthread_barrier_wait(barrier)
+#define PROBE_BEGIN(probe)
+#define PROBE_END(probe)
+#define COUNT_MOVES(n)
+#endif
+
+/*Positions are fixed point numbers: POSITION_UNITS units in a meter. Speeds (velocities) are in units per cycle: at 50km/h a cyclist rides 1m in a cycle*/
+#define POSITION_UNITS   256
+#define METER(position)  ((position) / POSITION_UNITS)
+#define KMH_PER_METER    50       /*Speed of a cyclist riding 1m per cycle, in km/h*/
+#define VELOCITY(kmh)    ((kmh) * POSITION_UNITS / KMH_PER_METER) /*Speed in km/h to units per cycle*/
+#define KMH(velocity)    ((velocity) * KMH_PER_METER / POSITION_UNITS)
+
+/*Speed profiles. Each cyclist rides towards his cruising speed (25km/h or 50km/h) at his own acceleration. 
+He rides 1/DRAFT_SHARE faster while the meter ahead of him is taken (drafting), and tires: after FATIGUE_LAPS laps his top speed is 
+fatigue/FATIGUE_SCALE lower, fatigue being his own in [0...FATIGUE_MAX]. Nobody rides faster than MAX_SPEED, so nobody moves more than MAX_SPAN meters ahead in a cycle*/
+#define ACCEL_MIN        4        /*Acceleration, in units per cycle per cycle*/
+#define ACCEL_MAX        16
+#define DRAFT_SHARE      16
+#define FATIGUE_LAPS     16
+#define FATIGUE_SCALE    1024
+#define FATIGUE_MAX      64
+#define MAX_SPEED        60       /*km/h*/
+#define MAX_SPAN         2
+/*Top speed of a cyclist in this cycle, and his velocity after it: he speeds up, or slows down, by accel towards top*/
+#define LAPS_TIRED(lap)  ((lap) - 1 < FATIGUE_LAPS ? (lap) - 1 : FATIGUE_LAPS)
+#define CAPPED(velocity) ((velocity) < VELOCITY(MAX_SPEED) ? (velocity) : VELOCITY(MAX_SPEED))
+#define TOP_SPEED(speed, draft, fatigue, lap) CAPPED((speed) + (draft) * ((speed) / DRAFT_SHARE) - (speed) * (fatigue) * LAPS_TIRED(lap) / (FATIGUE_LAPS * FATIGUE_SCALE))
+#define PACE(velocity, accel, top) ((velocity) + (accel) < (top) ? (velocity) + (accel) : ((velocity) - (accel) > (top) ? (velocity) - (accel) : (top)))
+
+/*Random number generator (PCG32). Each stream is an independent sequence, selected by inc, so every cyclist rolls his own numbers
+and no generator is shared between threads*/
+typedef struct rng {
+   uint64_t state;               /*Current state*/
+   uint64_t inc;                 /*Stream. Always odd*/
+} Rng;
+
+/*The cyclists of the race, stored as a structure of arrays: cyclist i is described by the i-th element of each array.
+The fields read or written in every cycle come first, so the per-cycle sweeps only touch the arrays they need*/
+typedef struct peloton { 
+   int *position;             /*Position in the track, in units. [0...POSITION_UNITS*track_size-1]. The meter is METER(position)*/
+   int *place;                /*His place of the race (1 for first, 2 for second... cyclist_competing for last (in actual lap))*/
+   int *speed;                /*Cruising speed of the cyclist, in units per cycle. VELOCITY(25km/h) or VELOCITY(50km/h)*/
+   int *velocity;             /*Speed of the cyclist in this cycle, in units per cycle*/
+   int *accel;                /*Acceleration of the cyclist, in units per cycle per cycle*/
+   int *fatigue;              /*Top speed the cyclist loses after FATIGUE_LAPS laps, in FATIGUE_SCALE-ths*/
+   int *draft;                /*Set while the meter ahead of the cyclist is taken (drafting)*/
+   int *lap;                  /*His actual lap*/
+   unsigned char *status;     /*Bitfield. ELIMINATED, BROKEN and CAUGHT*/
+   clock_t *cyclist_timer;    /*Elimination, broken or victory time*/
+   int *number;               /*Cyclist number*/
+   Rng *rng;                  /*Random stream of the cyclist: speed changes and break attempts*/
+   int *points;               /*Points scored in the sprints (points race)*/
+} Peloton;
+
+/*Each position of the track is a cell of type meter. 
+A cyclist gets into a meter by reserving one of its fields: bit i of occupancy is set while the field cyclist[i] is taken. 
+occupancy is the only synchronization of the meter: it is updated with compare-and-swap, so at most MAX_CYCLISTS cyclists are ever in the meter.
+The owner of a reserved field then writes himself (plus 1) in it. A reserved field may still be FREE_FIELD for a moment, so readers skip FREE_FIELD fields.
+A meter that was never written is all zero, which is an empty meter: the track needs no initialization*/
 typedef struct meter { 
-   sem_t mutex;                  /*Semaphore to allow a limited number os cyclists to get into this meter*/
-   pthread_mutex_t meter_lock;   /*Special lock to guarantee safe writing in this meter*/
-   Cyclist* cyclist1;            /*Field to assign 1st cyclist to this meter*/
-   Cyclist* cyclist2;            /*Field to assign 2nd cyclist to this meter*/
-   Cyclist* cyclist3;            /*Field to assign 3rd cyclist to this meter*/
-   Cyclist* cyclist4;            /*Field to assign 4th cyclist to this meter*/
-   int cyclists;                 /*Number of cyclists in this position of the track*/
+   unsigned int occupancy;       /*Bitmask of the reserved fields. The number of cyclists in this meter is the number of bits set*/
+   int cyclist[MAX_CYCLISTS];    /*Fields to assign cyclists to this meter: the cyclist plus 1 (or FREE_FIELD)*/
 } Meter;
 
+/*A cell of the event ring. The cell at position p of the ring is free for the producer of position p when sequence == p, 
+and holds the event of position p when sequence == p+1*/
+typedef struct event_cell {
+   unsigned long sequence;       /*Position (see above)*/
+   RaceEvent event;              /*The event*/
+} EventCell;
+
+/*Bounded lock-free ring of events. Any thread publishes events in it, omnium_logger() is the only one that consumes them.
+A producer never drops an event: if the ring is full he sleeps until the logger frees his cell*/
+typedef struct event_ring {
+   EventCell *cells;             /*The ring. [0...EVENT_RING_SIZE-1]*/
+   unsigned long head;           /*Next position to publish. Producers take it with compare-and-swap*/
+   char pad[64];                 /*Keeps head and tail in different cache lines*/
+   unsigned long tail;           /*Next position to consume. Written only by the logger*/
+   int closed;                   /*Set when the race is over and no more events will be published*/
+   int sleeping;                 /*Set while the logger waits for events*/
+   int full;                     /*Producers waiting for room in the ring*/
+   pthread_mutex_t lock;         /*Protects the sleep of the logger and of the producers*/
+   pthread_cond_t wakeup;        /*Signaled when an event is published (or the ring closed) while the logger sleeps*/
+   pthread_cond_t room;          /*Broadcast when the logger consumed events while producers wait for room*/
+} EventRing;
+
 /*Definition of the track*/
 typedef Meter* Track;
 
+/*A slot of the sparse track: a meter and its number*/
+typedef struct slot {
+   unsigned int key;             /*Meter number plus 1 (0 for a free slot)*/
+   Meter meter;
+} Slot;
+
+/*Sparse track (--track sparse): only the meters with cyclists are kept, in an open addressing hash table (linear probing) keyed by meter number.
+A meter missing from the table is empty. The slot of a meter is claimed with compare-and-swap when a cyclist reserves a field of it, 
+so the workers of a tick may claim slots at once. Slots are only freed between two ticks, by free_vacated_meters(), when no other thread looks at the table: 
+this is why the sparse track needs the lockstep or segment engine.
+Every cyclist claims at most one slot in a tick, and at most one slot per cyclist is taken at the end of a tick, so the table is never more than half full*/
+typedef struct sparse_track {
+   Slot *slots;                  /*The table. [0...mask]*/
+   unsigned int mask;            /*Number of slots minus 1. The number of slots is a power of 2*/
+   int *vacated;                 /*Meters left empty in this tick, that may be freed at its end*/
+   int vacancies;                /*Meters in vacated*/
+} SparseTrack;
+
+/*The memory of a race. The track, the cyclists, the standings, the threads and the workers are carved from a single anonymous mapping,
+so a race is set up with one mmap and torn down with one munmap. base is aligned to a huge page and the kernel is asked to back the arena with huge pages.
+Nothing is written when the arena is mapped: each page is zeroed and placed by the first thread that writes it*/
+typedef struct arena {
+   char *memory;                 /*The mapping*/
+   size_t size;                  /*Size of the mapping*/
+   char *base;                   /*First huge page boundary of the mapping*/
+   size_t used;                  /*Bytes carved from base*/
+   size_t capacity;              /*Bytes that can be carved from base*/
+} Arena;
+
+/*The standings of the race: the cyclists still competing, sorted by the distance they covered (lap, then meter).
+rank[k] is the cyclist in place k+1, and peloton.place[rank[k]] == k+1 always holds.
+A move only swaps the cyclist with the ones he passed, the last cyclist is rank[competing-1] and the cyclist in place k is rank[k-1]*/
+typedef struct standings {
+   int *rank;                    /*Cyclists from the first to the last place. [0...competing-1]*/
+   long *distance;               /*Distance covered by each cyclist, in meters. The key of the standings*/
+   int competing;                /*Number of cyclists in the standings*/
+   pthread_mutex_t lock;         /*Lock to guarantee safe writing in the standings*/
+} Standings;
+
+/*The counters every cyclist reads and changes as the race goes. They are only accessed with atomics, so none of them takes a lock: 
+a change is a release and a read an acquire, so a cyclist that sees a change also sees what was written before it.
+The cyclist that takes competing to 1 (or sets finished first) is the one that ends the race. try_to_break is only cleared by the cyclist it names, 
+if nobody rolled another one since. eliminated is taken by a single cyclist at a time (the last one of a lap: two cyclists tied in the last place 
+are not both eliminated) and only he gives it back, once he left the race*/
+typedef struct race_state {
+   int competing;                /*Number of cyclists still running (i.e not broken and not eliminated)*/
+   int finished;                 /*Set once a cyclist covered the FINISH_LAPS laps of the race*/
+   int try_to_break;             /*Cyclist that will suffer a break attempt (or EMPTY)*/
+   int eliminated;               /*Cyclist eliminated and still in the race, plus 1 (0 for nobody)*/
+} RaceState;
+
+/*Statistics of a batch of races, by starting place (place 1 is the front of the grid). 
+Arrays are indexed by starting place - 1*/
+typedef struct batch_totals {
+   long races;                   /*Races run*/
+   long ticks;                   /*Sum of the durations of the races, in cycles*/
+   long *wins;                   /*Races won by the cyclist starting in each place*/
+   long *podiums;                /*Races finished in one of the first 3 places*/
+   long *breaks;                 /*Races in which he broke*/
+   long *places;                 /*Sum of his final places*/
+} BatchTotals;
+
+/*A race asked to the server (--serve): a line of a client, parsed. id is the number of the line in its client*/
+typedef struct race_spec {
+   long id;
+   int client;                   /*Client that asked for the race*/
+   long generation;              /*Generation of the client when it asked (see Client)*/
+   int track_size;
+   int cyclists;
+   char mode;
+   char grid;
+   int heat_size;
+   unsigned long seed;
+   char sparse;                  /*Runs on a sparse track*/
+} RaceSpec;
+
+/*The outcome of a race run by a server job*/
+typedef struct race_result {
+   RaceSpec spec;                /*The race*/
+   int podium[3];                /*Numbers of the cyclists in the 1st, 2nd and 3rd places*/
+   int broken;                   /*Cyclists that broke*/
+   long ticks;                   /*Duration of the race, in cycles*/
+   long laps;                    /*Laps the cyclists completed*/
+   double wall;                  /*Seconds the job took to run the race*/
+} RaceResult;
+
+/*A client of the server: the standard input and output, or a connection to the server socket.
+A slot is reused by the next client once its connection is closed, with a new generation, so the results of a client that left are never sent to the next one*/
+typedef struct client {
+   int in;                       /*Where the races are read from (-1 once closed)*/
+   int out;                      /*Where the results are written to (-1 for a free slot)*/
+   long generation;
+   long lines;                   /*Lines read so far*/
+   long running;                 /*Races asked and not answered yet*/
+   char line[SPEC_BYTES];        /*Line being read*/
+   int length;                   /*Bytes in line*/
+} Client;
+
+/*A job of the server: a process that runs races, one after another, in the same arena*/
+typedef struct job {
+   pid_t pid;
+   int requests;                 /*Pipe where the server writes the races of the job (RaceSpec)*/
+   int results;                  /*Pipe where the job writes their results (RaceResult)*/
+   int busy;                     /*Set while the job runs a race*/
+} Job;
+
+/*Races waiting for a job, in the order they were asked. A circular buffer that doubles when full*/
+typedef struct race_queue {
+   RaceSpec *specs;
+   long first;                   /*Oldest race*/
+   long count;                   /*Races in the queue*/
+   long size;                    /*Capacity of specs*/
+} RaceQueue;
+
+/*A lockstep worker. Advances the cyclists [first...last-1] every tick*/
+typedef struct worker {
+   int id;                       /*Worker number [0...workers-1]*/
+   int first;                    /*First cyclist owned by this worker*/
+   int last;                     /*One past the last cyclist owned by this worker*/
+} Worker;
+
+/*Header of a snapshot of the race, taken at the end of a tick (lockstep and segment engines). It is followed by the arrays of the peloton 
+(position, place, speed, velocity, accel, fatigue, lap, status, cyclist_timer, number, rng, points), of the standings (rank, distance), of the engine (intent, retired), 
+by the sprints (sprinters) and by the occupied meters of the track (meter number, then the Meter). Everything is written in the sizes and byte order of the machine that ran the race*/
+typedef struct snapshot_header {
+   char magic[8];                /*SNAPSHOT_MAGIC*/
+   int32_t version;              /*SNAPSHOT_VERSION*/
+   int32_t mode;                 /*Simulation mode (u, v, U or V)*/
+   int32_t track_size;           /*Size of the track, in meters*/
+   int32_t total_cyclists;       /*Number of cyclists at the start of the race*/
+   int32_t cyclists_competing;
+   int32_t standings_competing;
+   int32_t try_to_break;
+   int32_t eliminated;           /*Cyclist eliminated and still in the race, plus 1 (0 for nobody)*/
+   int32_t occupied_meters;      /*Number of meters of the track written*/
+   int32_t rules;                /*Rule set of the race (see rules.h)*/
+   int32_t finished;
+   int32_t pad;
+   uint64_t seed;                /*Seed of the race*/
+   int64_t ticks;                /*Cycles run*/
+   int64_t moves;                /*Moves made*/
+   int64_t events;               /*Events in the binary log at the end of the tick*/
+   int64_t clock;                /*race_clock() at the end of the tick*/
+} SnapshotHeader;
+
+/*Writer of the trace. The file is written through a window of it mapped in memory, which slides forward as the trace grows.
+previous_* is the state of the cyclists in the last frame, that delta frames are computed from*/
+typedef struct tracer {
+   int fd;                       /*The trace file*/
+   unsigned char *window;        /*Mapped window of the file*/
+   long window_offset;           /*Offset of the window in the file. Multiple of the page size*/
+   long window_size;             /*Size of the window*/
+   long offset;                  /*Offset of the next frame in the file*/
+   long frames;                  /*Frames written*/
+   long max_frame;               /*Size of the biggest frame possible*/
+   int64_t *keyframes;           /*Offsets of the keyframes*/
+   long keyframes_size;          /*Capacity of keyframes*/
+   int *previous_position;
+   int *previous_lap;
+   int *previous_place;
+   TraceHeader header;
+} Tracer;
+
+/*Debug renderer. The chronometer copies the state of the cyclists into it and goes on; the renderer thread formats the copy in text
+and writes it at once. A frame submitted while the last one is still being written is dropped, so the race never waits for the terminal*/
+typedef struct renderer {
+   int *position;                /*Copy of the cyclists taken by the chronometer*/
+   int *place;
+   int *speed;
+   int *lap;
+   char *text;                   /*The frame in text*/
+   int pending;                  /*Set while a copy waits to be written*/
+   int closed;                   /*Set at the end of the race*/
+   long dropped;                 /*Frames dropped because the renderer was busy*/
+   pthread_mutex_t lock;         /*Protects pending and closed. The copy belongs to the renderer thread while pending is set*/
+   pthread_cond_t wakeup;        /*Signaled when a copy is submitted, or the renderer closed*/
+   pthread_t thread;
+} Renderer;
+
+/*A subscriber of the telemetry. pending holds the rest of a frame its socket did not take yet*/
+typedef struct subscriber {
+   int fd;                       /*Socket of the subscriber (-1 for a free slot)*/
+   int synced;                   /*Set when the last frame was queued whole: the next one can be a delta frame*/
+   int behind;                   /*Frames in a row the subscriber could not take*/
+   unsigned char *pending;       /*Rest of the last frame*/
+   long pending_length;          /*Bytes in pending*/
+   long pending_sent;            /*Bytes of pending already sent*/
+} Subscriber;
+
+/*Telemetry publisher (--telemetry, see telemetry.h). The chronometer copies the state of the cyclists into it every cycle and goes on; 
+the publisher thread encodes the copy and sends it to the subscribers without ever waiting for them. A copy taken while the last one 
+is still being sent is skipped. previous_* is the state of the last frame sent, that delta frames are computed from*/
+typedef struct telemetry {
+   int listener;                 /*Listening socket*/
+   Subscriber subscriber[TELEMETRY_SUBSCRIBERS];
+   int *position;                /*Copy of the cyclists taken by the chronometer*/
+   int *lap;
+   int *place;
+   unsigned char *status;
+   long tick;                    /*Cycle of the copy*/
+   int *previous_position;
+   int *previous_lap;
+   int *previous_place;
+   unsigned char *previous_status;
+   unsigned char *hello;         /*First message of every subscriber*/
+   long hello_length;
+   unsigned char *keyframe;      /*The copy, encoded as a keyframe*/
+   unsigned char *delta;         /*The copy, encoded as a delta frame*/
+   long max_frame;               /*Size of the biggest message possible*/
+   int pending;                  /*Set while a copy waits to be sent*/
+   int closed;                   /*Set at the end of the race*/
+   long skipped;                 /*Cycles not sent because the publisher was busy*/
+   long dropped;                 /*Subscribers dropped because they could not keep up*/
+   pthread_mutex_t lock;         /*Protects pending and closed. The copy belongs to the publisher thread while pending is set*/
+   pthread_cond_t wakeup;        /*Signaled when a copy is taken, or the publisher closed*/
+   pthread_t thread;
+} Telemetry;
+
+#ifdef INSTRUMENT
+/*Counters of a probe*/
+typedef struct probe {
+   unsigned long passes;         /*Times a thread went through it*/
+   unsigned long waits;          /*Times a thread had to wait*/
+   unsigned long nsec;      /*Total time waited, in nanoseconds*/
+   unsigned long max_nsec;  /*Longest wait*/
+   unsigned long histogram[HISTOGRAM_BUCKETS]; /*Waits by duration, in nanoseconds*/
+} Probe;
+
+/*Counters of a thread. Written only by their thread, so counting needs no synchronization*/
+typedef struct thread_stats {
+   Probe probe[PROBES];
+   struct timespec begin[PROBES];   /*Beginning of the current wait of each probe*/
+   unsigned long moves[HISTOGRAM_BUCKETS]; /*Ticks by the number of moves made (lockstep and segment engines)*/
+   struct thread_stats *next;       /*Next thread in the list of all threads*/
+} ThreadStats;
+#endif
+
+/*A segment of the track, owned by a worker of the segment engine. The worker moves the cyclists in the meters [first...last-1].
+Cyclists leaving the segment are handed to the next one through its inbox. Only the cyclists in the last MAX_SPAN meters of a segment can leave it, so the inbox never holds more than MAX_CYCLISTS*MAX_SPAN.
+A segment has at least MAX_SPAN meters, so a cyclist leaving a segment always moves into the next one*/
+typedef struct segment {
+   int first;                    /*First meter of the segment*/
+   int last;                     /*One past the last meter of the segment*/
+   int *roster;                  /*Cyclists in the segment*/
+   int riders;                   /*Number of cyclists in roster*/
+   int inbox[MAX_CYCLISTS * MAX_SPAN]; /*Cyclists of the previous segment moving into this one in this tick*/
+   int arrivals;                 /*Number of cyclists in inbox*/
+   long moves;                   /*Moves made in this tick*/
+   char pad[64];                 /*Keeps the segments of different workers in different cache lines*/
+} Segment;
+
+/*State of the cruise engine. The race runs in windows of period cycles, a number of times the cycles the velocities of the cyclists take 
+to cover whole meters. A window starts with the state of every cyclist kept. If it ends with every cyclist in that state, but for his shift (a whole number of meters ahead), 
+the race cruises: the next periods repeat the window, with the cyclists shifted and the events of the window published again, until something changes*/
+typedef struct cruise {
+   int *position;                /*Position of every cyclist at the start of the window*/
+   int *velocity;                /*Velocity of every cyclist at the start of the window*/
+   int *draft;                   /*Draft of every cyclist at the start of the window*/
+   int *lap;                     /*Lap of every cyclist at the start of the window*/
+   int *place;                   /*Place of every cyclist at the start of the window*/
+   int *field;                   /*Field of the meter of every cyclist at the start of the window*/
+   unsigned char *status;        /*Status of every cyclist at the start of the window*/
+   char *retired;                /*Was the cyclist retired at the start of the window?*/
+   int *shift;                   /*Meters every cyclist in the race covered in the window*/
+   int *order;                   /*Cyclists in the race (in the order of the track, once cruise_length() sorted them)*/
+   int riders;                   /*Cyclists in order*/
+   long tick;                    /*Cycle the window started in*/
+   int period;                   /*Cycles of the window*/
+   int stretch;                  /*Periods of the velocities in the window. Doubled after a window the race did not cruise through (up to CRUISE_STRETCH)*/
+   long moves;                   /*Moves made before the window*/
+   RaceEvent *log;               /*Events published in the window*/
+   int logged;                   /*Events published in the window (only the first CRUISE_EVENTS are in log)*/
+} Cruise;
+
+/*A bucket of the conflict pass of the lockstep engine: the cyclists moving into a meter in the current tick*/
+typedef struct bucket {
+   unsigned long pass;           /*Pass of the bucket. A bucket of an older pass is free*/
+   int meter;                    /*Meter the cyclists move into*/
+   int arrivals;                 /*Cyclists moving into the meter*/
+   int room;                     /*Fields free in the meter before the tick*/
+   int contested;                /*Set if a cyclist may not get into the meter, or may stop in it short of his own one*/
+   int first;                    /*First cyclist moving into the meter. The next ones follow in Conflicts.next*/
+} Bucket;
+
+/*Conflict pass of the lockstep engine (see resolve_conflicts()). The cyclists changing meter in a tick are bucketed by the meter they move into, 
+in an open addressing hash table (linear probing) keyed by meter number. It has as many buckets as the sparse track has slots, so it is never more than half full*/
+typedef struct conflicts {
+   Bucket *buckets;              /*The table. [0...mask]*/
+   unsigned int mask;            /*Number of buckets minus 1. The number of buckets is a power of 2*/
+   unsigned long pass;           /*Passes made, in every race of the process*/
+   int *next;                    /*next[i] is the cyclist moving into the meter of the cyclist i after him (EMPTY for the last one)*/
+   int *contested;               /*Contested buckets whose cyclists are still to be resolved*/
+   int *nearest;                 /*nearest[i] is the nearest meter ahead the cyclist i may stop in: his own meter when it is clear, the next one otherwise*/
+} Conflicts;
+
 /*Global variables related to number of cyclists. 
-cyclists_competing stores the number of cyclists still running (i.e not broken and not eliminated). 
 total_cyclists stores the total number of cyclists, passed through command line*/
-int cyclists_competing, total_cyclists;
-/*Global variable related to time. Contains the race time duration*/
-clock_t start_timer;
+int total_cyclists;
+/*Global variable with the shared state of the race: the cyclists still competing, the end of the race, the breaks and the eliminations*/
+RaceState race;
+/*Global variable containing all the cyclists. Cyclists are recognized by their index [0...total_cyclists-1]*/
+Peloton peloton;
+/*Global variables related to the rule set (see rules.h). 
+sprinters[s] is the number of cyclists that crossed the line of the sprint s+1 so far, and sprint_points the points of the first ones*/
+int sprinters[SPRINTS + 1];
+#if SPRINT_EVERY
+const int sprint_points[SPRINT_SCORERS] = SPRINT_POINTS;
+#endif
+/*Global variables related to time. 
+start_timer is the wall time the race started at (CLOCK_MONOTONIC): the threads of the race mostly sleep, so its duration is not the CPU time of the process.
+fast is set in headless mode: the simulation runs as fast as possible and the time is kept by a virtual clock.
+ticks is the virtual clock, counted in simulation cycles since the start of the race*/
+struct timespec start_timer;
+int fast;
+long ticks;
 /*Global variables related to the track. 
 track represents the track (an array of struct meter)
-track_size contains the size of the track. It goes from [0...track_size-1]*/
+track_size contains the size of the track. It goes from [0...track_size-1]
+sparse is set by --track sparse: the meters are kept in sparse_track instead, and track is not allocated. empty_meter stands for the meters it does not have*/
 Track track;
+int sparse;
+SparseTrack sparse_track;
+const Meter empty_meter;
+/*Global variable related to memory. arena holds everything allocated for a single race*/
+Arena arena;
 int track_size;
+/*Global variable with the events the logger still has to write*/
+EventRing events;
+/*Global variable with the places of the cyclists still competing*/
+Standings standings;
 /*Global variable that allows or not the cyclists to run. Used at the beggining of the race and of each cycle of the simulation (cycles of 0.72ms, as defined)*/
 int go;
+/*Global variables related to waiting.
+The cyclists sleep on start_signal until countdown() sets go. The chronometer sleeps on finish_signal between cycles, so it stops as soon as the race is over.
+Both are used with race_lock*/
+pthread_mutex_t race_lock;
+pthread_cond_t start_signal, finish_signal;
 /*Global variable related to simulation mode. Stores the mode. u and v for normal run, U and V for debug run*/
 char mode;
-/*Global variables. 
-try_to_break contains the cyclist (using his race position, aka cyclist->place) that will suffer a break attempt.
-update is used to allow the simulation to update all cyclists race position, given a cyclist has broken*/
-int try_to_break, update;
-/*Global variable: gives permission to eliminate a cyclists. This is to avoid double elimination (when there's a tie in the last position*/
-int already_eliminated;
-pthread_mutex_t elimination_lock;
+/*Global variables related to random numbers. 
+seed is the seed of every random stream of the race: the same seed gives the same race in lockstep mode.
+grid_rng is the stream used to draw the starting grid*/
+unsigned long seed;
+Rng grid_rng;
+/*Global variables related to the starting grid. 
+grid is RANDOM_GRID (the cyclists in a random order), RANKED_GRID (by number: #1 starts in the front) 
+or HEATS_GRID (heats of heat_size cyclists, the best numbers in the front heat, in a random order inside each heat)*/
+char grid;
+int heat_size;
+/*Global variables related to batch mode.
+batch is the number of races of the batch (0 for a single race), jobs the number of processes running them.
+quiet turns off everything printed during a race, logging turns the binary log on or off.
+totals are the statistics the races of this process add to (NULL outside batch mode)*/
+int batch, jobs, quiet, logging;
+BatchTotals *totals;
+/*Global variables related to server mode (--serve). 
+serving is set in the jobs of a server: their arena is kept from a race to the next. result is where a job reports the race that just ended (NULL outside server mode).
+The server reads races from clients, queues them in queue and hands them to the idle jobs*/
+int serving;
+RaceResult *result;
+Client clients[SERVER_CLIENTS];
+Job *job_pool;
+RaceQueue queue;
+/*Global variables related to the benchmark. 
+moves and laps count the moves (lockstep engine only) and the laps of the last race.
+A lockstep race is halted once it made move_budget moves (0 for no limit)*/
+long moves, laps, move_budget;
+int halted;
+/*Global variables related to the simulation engine.
+engine is THREAD_ENGINE (one thread per cyclist), LOCKSTEP_ENGINE (a fixed pool of workers advancing all cyclists in discrete ticks)
+or SEGMENT_ENGINE (a fixed pool of workers, each one advancing the cyclists in its own segment of the track, in discrete ticks)
+or CRUISE_ENGINE (a single worker, running the cycles of the lockstep engine but jumping the ones the race cruises through).
+workers is the size of the lockstep or segment pool.
+intent[i] is the position the cyclist i decided to move to in the current tick.
+retired[i] is set once the cyclist i left the race and was announced by broadcast().
+movers are the cyclists still short of their intent in the current tick of the lockstep engine, in the order they move.
+serial_moves is set when a single thread makes every move of the race (lockstep and cruise engines): the track and the standings are then 
+written without atomics or locks.
+tick_barrier separates the planning and the moving phases of each tick*/
+char engine;
+int workers;
+int *intent;
+char *retired;
+int *movers;
+int serial_moves;
+pthread_barrier_t tick_barrier;
+#ifdef INSTRUMENT
+/*Global variables related to instrumentation.
+my_stats are the counters of the running thread. all_stats is the list of the counters of every thread, protected by stats_lock.
+dump_requested is set by SIGUSR1: the chronometer dumps the counters at the end of the cycle*/
+__thread ThreadStats *my_stats;
+ThreadStats *all_stats;
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t dump_requested;
+#endif
+/*Global variables related to snapshots.
+A snapshot is taken every snapshot_every cycles (0 for never), once next_snapshot is reached, and written by snapshot_thread while the race goes on. 
+snapshot_writing is set while it writes. resume_file is the snapshot the race resumes from (or NULL).
+logged_events is the number of events already in the binary log when the race started (not 0 only when resuming), and flushed_events the number in the file now.
+clock_offset is the race time already run when the race started*/
+long snapshot_every, next_snapshot, logged_events, flushed_events;
+int snapshot_writing, snapshot_started;
+size_t snapshot_size;
+pthread_t snapshot_thread;
+char *resume_file;
+clock_t clock_offset;
+/*Global variables related to the debug renderer (modes U and V).
+debug_every is the number of cycles between two frames, and debug_rows the most cyclists shown in a frame (0 for all)*/
+int debug_every, debug_rows;
+Renderer renderer;
+/*Global variables related to the trace. tracing is set by --trace*/
+int tracing;
+Tracer tracer;
+/*Global variables related to the telemetry. streaming is set by --telemetry*/
+int streaming;
+Telemetry telemetry;
+/*Global variables related to the segment engine. 
+segments[k] is the segment of the worker k, and segments[(k+1) % workers] the next one.
+segments_running is cleared by segment_tick() once the race is over. Workers read it only after the last barrier of a tick, 
+as cyclists may leave the race (and end it) while the other workers sweep their segments*/
+Segment *segments;
+int segments_running;
+/*Global variable related to the cruise engine*/
+Cruise cruise;
+/*Global variable related to the conflict pass of the lockstep engine*/
+Conflicts conflicts;
 
 /*Functions prototypes*/
-int roll_speed();
-int roll_cyclist_to_try_to_break();
+int roll_speed(int);
+int roll_cyclist_to_try_to_break(int);
+void release_elimination(int);
+int cyclists_competing();
+void rng_seed(Rng*, unsigned long, unsigned long);
+uint32_t rng_next(Rng*);
+int rng_below(Rng*, int);
 int *initial_configuration(int);
-int set_cyclists(int *, int, int, int, int);
+void shuffle_grid(int*, int);
 void make_track();
-void make_cyclists(Cyclist*, int*, int, int);
-void put_cyclists_in_track(Cyclist*, int);
-void create_threads(int, pthread_t*, Cyclist*);
+unsigned int sparse_slots(int);
+Meter *find_meter(int);
+Meter *claim_meter(int);
+long find_slot(int);
+void free_vacated_meters();
+void clear_track();
+void make_arena(int);
+size_t arena_size(int);
+void *arena_alloc(size_t);
+void destroy_arena();
+void make_cyclists(int*, int, int);
+void put_cyclists_in_track(int);
+void create_threads(int, pthread_t*);
 void join_threads(int, pthread_t*);
 void create_time_thread(pthread_t);
 void join_time_thread(pthread_t);
@@ -84,41 +663,212 @@ void *omnium_chronometer(void*);
 void *omnium_logger(void*);
 void countdown();
 void await(int);
-int disqualified(Cyclist*);
-void overtake(Cyclist*, int);
-void break_cyclist(Cyclist*);
-void broadcast(Cyclist*);
-void mark_cyclist(Cyclist*, char);
-void eliminate_cyclist(Cyclist*, int);
-int decide_new_position(Cyclist*);
-void critical_section(Cyclist*, int, int);
-void print_cyclist(Cyclist);
-void print_cyclists(Cyclist*);
-int lap_complete(int);
-void write_cyclist(Cyclist*, int);
-void erase_cyclist(Cyclist*, int);
-void new_lap(Cyclist*, int);
-void update_places(Cyclist*);
+void wait_for_start();
+int wait_for_cycle(struct timespec*);
+void finish_race();
+void wait_for_events();
+int event_ready();
+int disqualified(int);
+void make_standings(int);
+void destroy_standings();
+void standings_advance(int);
+void standings_remove(int);
+void standings_drop(int);
+int standings_rank(int);
+void break_cyclist(int);
+void broadcast(int);
+void mark_cyclist(int, char);
+void eliminate_cyclist(int);
+int decide_new_position(int);
+void plan_moves(int, int);
+int reserve_on_the_way(int, int*, int);
+void critical_section(int, int, int, int);
+void print_cyclists();
+int format_cyclists(char*, int*, int*, int*, int*);
+void start_renderer();
+void stop_renderer();
+void submit_frame();
+void *omnium_renderer(void*);
+int lap_complete(int, int);
+void write_cyclist(int, int, int);
+void erase_cyclist(int, int);
+void new_lap(int, int, int);
+void sprint(int);
+void finish_cyclist();
+void catch_cyclists(int, int, int);
+void eliminate_caught(int);
+void classify();
+void order_by_points();
+void announce(int);
 int input_checker(int, char **);
 char get_mode(char **);
-void destroy_locks_and_semaphores();
-void write_log_elimination_info(Cyclist*);
-void write_log_break_info(Cyclist *cyclist);
-void update_timers(Cyclist*);
+int reserve_field(int, int);
+void futex_wait(unsigned int*, unsigned int);
+void futex_wake(unsigned int*);
+void release_field(int, int);
+int cyclists_in(int);
+void write_log_elimination_info(int);
+void write_log_break_info(int cyclist);
+void make_event_ring();
+void destroy_event_ring();
+void publish_event(RaceEvent*);
+void wait_for_room(EventCell*, unsigned long);
+void wake_producers();
+int consume_event(RaceEvent*);
+void close_event_ring();
+void log_event(int, int, int);
+void log_winners();
+void update_timers();
+void get_options(int, char **);
+void create_workers(int, pthread_t*, Worker*);
+void join_workers(int, pthread_t*);
+void *omnium_lockstep(void*);
+void lockstep_moves();
+int resolve_conflicts();
+Bucket *find_bucket(int, int);
+int lockstep_move(int, int);
+void retire_cyclist(int);
+void lockstep_chronometer(int);
+void create_segments(int, pthread_t*);
+void *omnium_segments(void*);
+void segment_sweep(int);
+void segment_arrivals(int);
+int in_segment(Segment*, int);
+void segment_tick(int);
+void make_cruise(int);
+void *omnium_cruise(void*);
+void open_window();
+int cruising();
+long cruise_length();
+void leap(long);
+int field_of(int);
+int by_position(const void*, const void*);
+clock_t race_clock();
+void rest(int);
+void run_race();
+void run_batch();
+void make_totals(BatchTotals*, int);
+void destroy_totals(BatchTotals*);
+void tally_race(BatchTotals*);
+void add_totals(BatchTotals*, BatchTotals*, int);
+void write_all(int, void*, size_t);
+void read_all(int, void*, size_t);
+void send_totals(int, BatchTotals*, int);
+void receive_totals(int, BatchTotals*, int);
+void print_summary(BatchTotals*, unsigned long);
+void serve(int, char **);
+void start_jobs();
+void stop_jobs();
+void run_job(int, int);
+void record_result(RaceResult*);
+void accept_client(int);
+void read_client(int);
+void take_line(int, char*);
+const char *parse_spec(char*, RaceSpec*);
+void dispatch();
+void collect_result(Job*);
+void send_line(int, const char*);
+void close_client(int);
+void enqueue(RaceSpec*);
+void dequeue(RaceSpec*);
+long count_laps();
+void tick_done();
+void open_trace();
+void trace_frame();
+void close_trace();
+void slide_trace_window(long);
+unsigned char *put_varint(unsigned char*, uint32_t);
+uint32_t zigzag(int);
+void take_snapshot();
+int by_meter(const void*, const void*);
+void *write_snapshot(void*);
+void finish_snapshots();
+void load_snapshot(const char*);
+void read_snapshot(FILE*, void*, size_t, const char*);
+void start_telemetry();
+void stop_telemetry();
+void sample_telemetry();
+void copy_telemetry();
+void *omnium_publisher(void*);
+void publish_frame();
+void accept_subscribers();
+long encode_keyframe(unsigned char*);
+long encode_delta(unsigned char*);
+long encode_end(unsigned char*);
+void send_frame(Subscriber*, unsigned char*, long);
+int flush_subscriber(Subscriber*);
+int send_whole(int, unsigned char*, long);
+void drop_subscriber(Subscriber*);
+void end_telemetry();
+#ifdef INSTRUMENT
+ThreadStats *thread_stats();
+void probe_begin(int);
+void probe_end(int);
+void record_wait(Probe*, unsigned long);
+int probed_lock(pthread_mutex_t*, int);
+int probed_barrier_wait(pthread_barrier_t*);
+void count_moves(long);
+int histogram_bucket(unsigned long);
+void reset_stats();
+void dump_stats();
+void request_dump(int);
+void check_dump_request();
+#endif
+#ifdef BENCHMARK
+int benchmark(int, char **);
+void bench_race(char, int, int);
+#endif
 
 int main(int argc, char **argv)
 {
-   int cyclists, *initial_config, initial_speed;
-   /*threads array. Each cyclist is a thread.*/
+#ifdef INSTRUMENT
+   struct sigaction action;
+   memset(&action, 0, sizeof(action));
+   action.sa_handler = request_dump;
+   sigaction(SIGUSR1, &action, NULL);
+#endif
+#ifdef BENCHMARK
+   return benchmark(argc, argv);
+#endif
+   if(argc > 1 && strcmp(argv[1], "--serve") == 0)
+   {
+      serve(argc, argv);
+      return 0;
+   }
+   /*Get initial information to feed the program*/
+   total_cyclists = input_checker(argc, argv);
+   mode = get_mode(argv);
+   /*Sets the size of the track*/
+   track_size = atoi(argv[1]);
+   get_options(argc, argv);
+
+   if(batch > 0) run_batch();
+   else
+   {
+      if(resume_file == NULL) printf("\nSeed: %lu\n", seed);
+      run_race();
+   }
+   return 0;
+}
+
+/*Runs a race, with the global configuration (track_size, total_cyclists, mode, seed and options)*/
+void run_race()
+{
+   int i, cyclists = total_cyclists, *initial_config, initial_speed;
+   /*threads array. Each cyclist is a thread (or, in lockstep mode, each worker is a thread).*/
    pthread_t *my_threads;
    /*thread in charge of the time elapsed in the simulation*/
    pthread_t time_thread, log_thread;
-   /*Thread arguments is the cyclist struct*/
-   Cyclist *thread_args;
+   /*Lockstep workers arguments*/
+   Worker *pool = NULL;
 
-   /*Get initial information to feed the program*/
-   total_cyclists = cyclists_competing = cyclists = input_checker(argc, argv);
-   mode = get_mode(argv);
+   memset(&race, 0, sizeof(race));
+   race.competing = cyclists;
+   serial_moves = engine == LOCKSTEP_ENGINE || engine == CRUISE_ENGINE;
+   memset(sprinters, 0, sizeof(sprinters));
+   /*Maps the memory of the race and allocates the track, at the beginning of it*/
+   make_arena(cyclists);
+   make_track();
    if(mode == 'u' || mode == 'U') initial_speed = 50;
    else initial_speed = 25;
 
@@ -126,343 +876,669 @@ int main(int argc, char **argv)
    initial_config = initial_configuration(cyclists);
 
    /*Threads (cyclists).*/
-   my_threads = malloc(cyclists * sizeof(*my_threads));
-   /*Thread args (cyclist structs)*/
-   thread_args = malloc(cyclists * sizeof(Cyclist));
+   my_threads = arena_alloc(cyclists * sizeof(*my_threads));
 
    /*Sets go to false. Cyclists can't start unless go is true*/
    go = 0;
+   moves = laps = ticks = 0;
+   halted = 0;
+   logged_events = clock_offset = 0;
+   next_snapshot = snapshot_every;
+   snapshot_writing = snapshot_started = 0;
+#ifdef INSTRUMENT
+   reset_stats();
+#endif
 
-   /*Sets the size of the track*/
-   /*Multiplied by 2 because cyclist can move 0.5m when they are with a speed of 25km/h*/
-   track_size = atoi(argv[1]);
-
-   /*Initialize global variables related to break functionality*/
-   try_to_break = total_cyclists + 1;
-   update = 0;
+   /*Nobody will suffer a break attempt yet*/
+   race.try_to_break = EMPTY;
 
-   /*Initialize global variables related to elimination functionality*/
-   already_eliminated = 0;
-   if (pthread_mutex_init(&elimination_lock, NULL) != 0)
+   if (pthread_mutex_init(&race_lock, NULL) != 0 || pthread_cond_init(&start_signal, NULL) != 0 || pthread_cond_init(&finish_signal, NULL) != 0)
    {
-      printf("\nElimination MUTEX initialization failed.\n");
+      printf("\nRace start and finish signals initialization failed.\n");
       exit(1);
    }
 
-   /*Allocates the track*/
-   make_track();
+   /*Allocates the event ring. Without the binary log nothing is published, so a batch or server race does not touch it*/
+   if(logging) make_event_ring();
 
    /*Now the program is ready to go*/
-   printf("\nPlacing competitors...\n\n");
-   sleep(1);
-   make_cyclists(thread_args, initial_config, initial_speed, cyclists);
-   put_cyclists_in_track(thread_args, cyclists);
-   print_cyclists(thread_args);
-   create_threads(cyclists, my_threads, thread_args);
-   sleep(1);
-   printf("\nAdjusting chronometer... ");
-   sleep(3);
-   if (pthread_create(&time_thread, NULL, omnium_chronometer, thread_args)) 
+   if(!quiet) printf("\nPlacing competitors...\n\n");
+   rest(1);
+   make_cyclists(initial_config, initial_speed, cyclists);
+   put_cyclists_in_track(cyclists);
+   make_standings(cyclists);
+   if(resume_file == NULL) print_cyclists();
+   intent = arena_alloc(cyclists * sizeof(int));
+   for(i = 0; i < cyclists; i++) intent[i] = peloton.position[i];
+   if(engine != THREAD_ENGINE) 
+   {
+      retired = arena_alloc(cyclists * sizeof(char));
+      movers = arena_alloc(cyclists * sizeof(int));
+      conflicts.buckets = arena_alloc(sparse_slots(cyclists) * sizeof(Bucket));
+      conflicts.mask = sparse_slots(cyclists) - 1;
+      conflicts.next = arena_alloc(cyclists * sizeof(int));
+      conflicts.contested = arena_alloc(cyclists * sizeof(int));
+      conflicts.nearest = arena_alloc(cyclists * sizeof(int));
+      if(resume_file != NULL) load_snapshot(resume_file);
+      flushed_events = logged_events;
+      if(tracing) open_trace();
+      if(pthread_barrier_init(&tick_barrier, NULL, workers) != 0)
+      {
+         printf("\nTick BARRIER initialization failed.\n");
+         exit(1);
+      }
+      if(engine == SEGMENT_ENGINE) create_segments(workers, my_threads);
+      else if(engine == CRUISE_ENGINE)
+      {
+         make_cruise(cyclists);
+         if (pthread_create(&my_threads[0], NULL, omnium_cruise, NULL)) 
+         {
+            printf("Error creating worker.");
+            abort();
+         }
+      }
+      else 
+      {
+         pool = arena_alloc(workers * sizeof(Worker));
+         create_workers(workers, my_threads, pool);
+      }
+   }
+   else create_threads(cyclists, my_threads);
+   rest(1);
+   if(!quiet) printf("\nAdjusting chronometer... ");
+   if(DEBUGGING) start_renderer();
+   if(streaming) start_telemetry();
+   rest(3);
+   if (pthread_create(&time_thread, NULL, omnium_chronometer, NULL)) 
    {
       printf("Error creating time thread.");
       abort();
    }
-   if (pthread_create(&log_thread, NULL, omnium_logger, thread_args)) 
+   if (logging && pthread_create(&log_thread, NULL, omnium_logger, NULL)) 
    {
       printf("Error creating log thread.");
       abort();
    } 
 
    join_time_thread(time_thread);
-   join_log_thread(log_thread);
-   join_threads(cyclists, my_threads);
-   free(initial_config);
-   free(my_threads);
-   free(thread_args);
-   destroy_locks_and_semaphores();
-   pthread_mutex_destroy(&elimination_lock);
-   free(track);
-   return 0;
+   if(engine != THREAD_ENGINE) 
+   {
+      join_workers(workers, my_threads);
+      finish_snapshots();
+      if(tracing) close_trace();
+      pthread_barrier_destroy(&tick_barrier);
+   }
+   else join_threads(cyclists, my_threads);
+   if(DEBUGGING) stop_renderer();
+#if FINISH_LAPS
+   classify();
+#endif
+   if(streaming) stop_telemetry();
+   /*Every cyclist is done: the winners are the last event of the race*/
+   if(logging)
+   {
+      log_winners();
+      close_event_ring();
+      join_log_thread(log_thread);
+   }
+   if(totals != NULL) tally_race(totals);
+   laps = count_laps();
+   if(result != NULL) record_result(result);
+#ifdef INSTRUMENT
+   if(batch == 0) dump_stats();
+#endif
+   if(logging) destroy_event_ring();
+   destroy_standings();
+   pthread_cond_destroy(&start_signal);
+   pthread_cond_destroy(&finish_signal);
+   pthread_mutex_destroy(&race_lock);
+   /*The track, the cyclists, the threads... go at once*/
+   destroy_arena();
 }
 
-/*Critical Section*/
-void critical_section(Cyclist *cyclist, int old_position, int new_position)
+/*Critical Section. Positions are in units (see POSITION_UNITS). The cyclist already reserved the field "field" of his new meter*/
+void critical_section(int cyclist, int old_position, int new_position, int field)
 {
-   /*Lock relative to his new position*/
-   pthread_mutex_lock(&track[new_position].meter_lock);
-      /*If he is going to complete a lap, increments. Will eliminate the worst cyclist too.*/
-      new_lap(cyclist, new_position);
-      /*Writes the cyclist in the new position*/
-      if(cyclist->eliminated == 'N' && cyclist->broken == 'N') write_cyclist(cyclist, new_position);
-   pthread_mutex_unlock(&track[new_position].meter_lock);
+#if ELIMINATE_CAUGHT
+   /*A caught cyclist is eliminated instead of moving*/
+   if(peloton.status[cyclist] & CAUGHT) eliminate_caught(cyclist);
+   else
+#endif
+   /*If he is going to complete a lap, increments. Will eliminate the worst cyclist too.*/
+   new_lap(cyclist, old_position, new_position);
+   /*Writes the cyclist in the new position*/
+   if(!disqualified(cyclist)) write_cyclist(cyclist, new_position, field);
    
-   /*Lock relative to his old position*/
-   pthread_mutex_lock(&track[old_position].meter_lock);
-      /*Swap places in case of an overtake*/
-      if(cyclist->eliminated == 'N' && cyclist->broken == 'N') overtake(cyclist, old_position);
-      /*Releases cyclist old position*/
-      erase_cyclist(cyclist, old_position);
-      /*If he is eliminated, the number of cyclists in the competition is decreased*/
-      if(cyclist->eliminated == 'Y' || cyclist->broken == 'Y') cyclists_competing--;
-   pthread_mutex_unlock(&track[old_position].meter_lock);
+   /*Swap places in case of an overtake*/
+   if(!disqualified(cyclist)) standings_advance(cyclist);
+#if ELIMINATE_CAUGHT
+   if(!disqualified(cyclist)) catch_cyclists(cyclist, METER(old_position), METER(new_position));
+#endif
+#if FINISH_LAPS
+   if(!disqualified(cyclist) && standings.distance[cyclist] >= (long)FINISH_LAPS * track_size) finish_cyclist();
+#endif
+   /*Releases cyclist old position*/
+   erase_cyclist(cyclist, old_position);
+   /*If he is eliminated, the number of cyclists in the competition is decreased*/
+   if(disqualified(cyclist) && __atomic_sub_fetch(&race.competing, 1, __ATOMIC_ACQ_REL) == 1) finish_race();
 }
 
 /*If he is going to complete a new lap, do tasks relative to this*/
-void new_lap(Cyclist *cyclist, int new_position)
+void new_lap(int cyclist, int old_position, int new_position)
 {
-   if(lap_complete(new_position)) 
+   if(lap_complete(old_position, new_position)) 
    {
       /*Increments his lap*/
-      (cyclist->lap)++;
+      peloton.lap[cyclist]++;
+      log_event(EVENT_LAP, cyclist, EMPTY);
 
+#if ELIMINATE_LAST
       /*Eliminate the cyclist is he is the worst in the competition*/
-      eliminate_cyclist(cyclist, new_position);
+      eliminate_cyclist(cyclist);
       write_log_elimination_info(cyclist);
+#endif
 
-      /*If he is at the first position in the race and his lap is a multiple of 4, choose a cyclist to try to break*/
-      if(cyclist->lap > 1 && cyclist->place == 1 && cyclist->lap % 4 == 1) try_to_break = roll_cyclist_to_try_to_break();      
+#if SPRINT_EVERY
+      if((peloton.lap[cyclist] - 1) % SPRINT_EVERY == 0) sprint(cyclist);
+#endif
+
+#if BREAK_EVERY
+      /*If he is at the first position in the race and completed a multiple of BREAK_EVERY laps, choose a cyclist to try to break*/
+      if(peloton.lap[cyclist] > 1 && peloton.place[cyclist] == 1 && (peloton.lap[cyclist] - 1) % BREAK_EVERY == 0) 
+         __atomic_store_n(&race.try_to_break, roll_cyclist_to_try_to_break(cyclist), __ATOMIC_RELEASE);
 
       /*See if this cyclist will break*/
-      if(try_to_break == cyclist->place) break_cyclist(cyclist);
+      if(__atomic_load_n(&race.try_to_break, __ATOMIC_ACQUIRE) == cyclist) break_cyclist(cyclist);
+#endif
 
       /*Attempts to change cyclist speed (omnium_v only) */
-      if(mode == 'v' || mode == 'V') cyclist->speed = roll_speed();
+      if(mode == 'v' || mode == 'V') peloton.speed[cyclist] = VELOCITY(roll_speed(cyclist));
    }
 }
 
-void write_log_elimination_info(Cyclist *cyclist)
+/*The cyclist crossed the line of a sprint. The first SPRINT_SCORERS cyclists to cross it score*/
+void sprint(int cyclist)
 {
-   int special_position = track_size;
-   pthread_mutex_lock(&track[special_position].meter_lock);
-   if(cyclist->place == cyclists_competing - 2) 
-   {
-      if(track[special_position].cyclist1 == NULL) { track[special_position].cyclist1 = cyclist; (track[special_position].cyclists)++; }
-   }
-   if(cyclist->place == cyclists_competing - 1)
-   {
-      if(track[special_position].cyclist2 == NULL) { track[special_position].cyclist2 = cyclist; (track[special_position].cyclists)++; }
-   }
-   if(cyclist->place == cyclists_competing)
+#if SPRINT_EVERY
+   int s = (peloton.lap[cyclist] - 1) / SPRINT_EVERY - 1, order;
+
+   if(s >= SPRINTS) return;
+   order = __atomic_fetch_add(&sprinters[s], 1, __ATOMIC_SEQ_CST);
+   if(order < SPRINT_SCORERS) peloton.points[cyclist] += sprint_points[order];
+#endif
+}
+
+/*A cyclist covered the laps of the race: it is over*/
+void finish_cyclist()
+{
+   if(__atomic_exchange_n(&race.finished, 1, __ATOMIC_ACQ_REL) == 0) finish_race();
+}
+
+/*Marks the cyclists caught by the cyclist: the ones in the meters he rode through (old_meter excluded) that covered less than him. 
+Each one is eliminated in his next move*/
+void catch_cyclists(int cyclist, int old_meter, int new_meter)
+{
+   int field, other, meter = old_meter;
+   while(meter != new_meter)
    {
-      if(track[special_position].cyclist3 == NULL) { track[special_position].cyclist3 = cyclist; (track[special_position].cyclists)++; }
+      meter = (meter + 1) % track_size;
+      for(field = 0; field < MAX_CYCLISTS; field++)
+      {
+         other = __atomic_load_n(&find_meter(meter)->cyclist[field], __ATOMIC_ACQUIRE) - 1;
+         if(other == EMPTY || other == cyclist || disqualified(other)) continue;
+         if(standings.distance[other] < standings.distance[cyclist]) __atomic_fetch_or(&peloton.status[other], CAUGHT, __ATOMIC_SEQ_CST);
+      }
    }
-   pthread_mutex_unlock(&track[special_position].meter_lock);
 }
 
-void write_log_break_info(Cyclist *cyclist)
+/*Eliminates a caught cyclist*/
+void eliminate_caught(int cyclist)
+{
+   mark_cyclist(cyclist, 'E');
+   log_event(EVENT_ELIMINATION, cyclist, EMPTY);
+}
+
+/*Places the cyclists still competing at the end of a race of FINISH_LAPS laps, after every cyclist stopped, and announces them.
+In a points race they are placed by their points, then by the distance they covered. Otherwise the standings are the result*/
+void classify()
+{
+   int k;
+#if SPRINT_EVERY
+   order_by_points();
+#endif
+   for(k = 0; k < standings.competing; k++) peloton.place[standings.rank[k]] = k + 1;
+   for(k = 0; k < standings.competing; k++) announce(standings.rank[k]);
+}
+
+/*Sorts the standings by points. The sort is stable, so cyclists with the same points keep the order of the distance they covered*/
+void order_by_points()
 {
-   int special_position = track_size;
-   pthread_mutex_lock(&track[special_position].meter_lock);
-      if(track[special_position].cyclist4 == NULL) { track[special_position].cyclist4 = cyclist; (track[special_position].cyclists)++; }
-   pthread_mutex_unlock(&track[special_position].meter_lock);
+#if SPRINT_EVERY
+   int most = sprint_points[0] * SPRINTS, *count, *sorted, k;
+
+   /*Counting sort, on most-points (0 for the most points)*/
+   count = calloc(most + 2, sizeof(int));
+   sorted = malloc(standings.competing * sizeof(int));
+   for(k = 0; k < standings.competing; k++) count[most - peloton.points[standings.rank[k]] + 1]++;
+   for(k = 1; k <= most + 1; k++) count[k] += count[k - 1];
+   for(k = 0; k < standings.competing; k++) sorted[count[most - peloton.points[standings.rank[k]]]++] = standings.rank[k];
+   memcpy(standings.rank, sorted, standings.competing * sizeof(int));
+   free(count);
+   free(sorted);
+#endif
+}
+
+/*Logs the cyclist if he crossed the line in one of the last 3 places*/
+void write_log_elimination_info(int cyclist)
+{
+   int slot = peloton.place[cyclist] - cyclists_competing() + 3;
+   if(slot >= 1 && slot <= 3) log_event(EVENT_LOSER, cyclist, slot);
+}
+
+/*Logs the broken cyclist*/
+void write_log_break_info(int cyclist)
+{
+   log_event(EVENT_BREAK, cyclist, EMPTY);
 }
 
 /*Attempts to break the cyclist*/
-void break_cyclist(Cyclist *cyclist)
+void break_cyclist(int cyclist)
 {
-   /*The remaining last 3 cyclists are immune to break attempts*/
-   if(cyclist->eliminated == 'N' && cyclists_competing > 3)
+   int rolled = cyclist;
+
+   /*The remaining last BREAK_IMMUNE cyclists are immune to break attempts*/
+   if(!(peloton.status[cyclist] & ELIMINATED) && cyclists_competing() > BREAK_IMMUNE)
    {
-      /*1% chance to break the cyclist*/
-      if(rand() % 100 == 0) 
+      /*1 in BREAK_CHANCE to break the cyclist*/
+      if(rng_below(&peloton.rng[cyclist], BREAK_CHANCE) == 0) 
       { 
+         /*He broke. Marking him takes him to the last place of this lap, and the cyclists behind him gain a place*/
          mark_cyclist(cyclist, 'B');
-         /*He broke. He is now in the last place of this lap*/
-         cyclist->place = cyclists_competing;
-         /*Calls for update cyclists places because someone broke*/
-         update = 1; 
-         /*Write in the special position of the track this cyclist will break*/
+         /*Unless the leader already rolled another cyclist*/
+         __atomic_compare_exchange_n(&race.try_to_break, &rolled, EMPTY, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+         /*Write in the log this cyclist broke*/
          write_log_break_info(cyclist);
       }
    }
 }
 
-/*Swap cyclists places in the case of an overtaking.*/
-void overtake(Cyclist *cyclist, int position)
+/*Allocates the standings. At the start of the race the cyclist i is in the place cyclists-i*/
+void make_standings(int cyclists)
 {
-   int temp;
-   /*Must update places*/
-   if(track[position].cyclists > 0)
+   int i;
+   standings.rank = arena_alloc(cyclists * sizeof(int));
+   standings.distance = arena_alloc(cyclists * sizeof(long));
+   standings.competing = cyclists;
+   for(i = 0; i < cyclists; i++)
    {
-      if(track[position].cyclist1 != NULL && track[position].cyclist1 != cyclist)
-      {
-         if(((*track[position].cyclist1).place < cyclist->place) && ((*track[position].cyclist1).lap <= cyclist->lap))
-         {
-            temp = cyclist->place;
-            cyclist->place = (*track[position].cyclist1).place;
-            (*track[position].cyclist1).place = temp;
-         }
-      }
-      if(track[position].cyclist2 != NULL && track[position].cyclist2 != cyclist)
-      {
-         if(((*track[position].cyclist2).place < cyclist->place) && ((*track[position].cyclist2).lap <= cyclist->lap))
-         {
-            temp = cyclist->place;
-            cyclist->place = (*track[position].cyclist2).place;
-            (*track[position].cyclist2).place = temp;
-         }
-      }
-      if(track[position].cyclist3 != NULL && track[position].cyclist3 != cyclist)
+      standings.rank[peloton.place[i] - 1] = i;
+      standings.distance[i] = METER(peloton.position[i]) - HEAD_START(i);
+   }
+   if (pthread_mutex_init(&standings.lock, NULL) != 0)
+   {
+      printf("\nStandings MUTEX initialization failed.\n");
+      exit(1);
+   }
+}
+
+/*Destroys the lock of the standings. They are freed with the arena*/
+void destroy_standings()
+{
+   pthread_mutex_destroy(&standings.lock);
+}
+
+/*Updates the distance of the cyclist after a move, swapping places with the cyclists he overtook. The lock is only needed if cyclists move in parallel*/
+void standings_advance(int cyclist)
+{
+   int k, other;
+   if(!serial_moves) LOCK(&standings.lock, PROBE_STANDINGS);
+      standings.distance[cyclist] = (long)(peloton.lap[cyclist] - 1) * track_size + METER(peloton.position[cyclist]) - HEAD_START(cyclist);
+      for(k = peloton.place[cyclist] - 1; k > 0 && standings.distance[standings.rank[k - 1]] < standings.distance[cyclist]; k--)
       {
-         if(((*track[position].cyclist3).place < cyclist->place) && ((*track[position].cyclist3).lap <= cyclist->lap))
-         {
-            temp = cyclist->place;
-            cyclist->place = (*track[position].cyclist3).place;
-            (*track[position].cyclist3).place = temp;
-         }
+         other = standings.rank[k - 1];
+         standings.rank[k] = other;
+         peloton.place[other] = k + 1;
+         peloton.place[cyclist] = k;
+         log_event(EVENT_OVERTAKE, cyclist, other);
       }
-      if(track[position].cyclist4 != NULL && track[position].cyclist4 != cyclist)
-      {
-         if(((*track[position].cyclist4).place < cyclist->place) && ((*track[position].cyclist4).lap <= cyclist->lap))
-         {
-            temp = cyclist->place;
-            cyclist->place = (*track[position].cyclist4).place;
-            (*track[position].cyclist4).place = temp;
-         }
-      }  
-   }
+      standings.rank[k] = cyclist;
+      peloton.place[cyclist] = k + 1;
+   if(!serial_moves) pthread_mutex_unlock(&standings.lock);
 }
 
-/*Eliminates the worst cyclist of the lap*/
-void eliminate_cyclist(Cyclist *cyclist, int new_position)
+/*Takes the cyclist out of the standings*/
+void standings_remove(int cyclist)
+{
+   LOCK(&standings.lock, PROBE_STANDINGS);
+      standings_drop(cyclist);
+   pthread_mutex_unlock(&standings.lock);
+}
+
+/*Takes the cyclist out of the standings, with their lock held. He gets the last place and the cyclists behind him gain a place*/
+void standings_drop(int cyclist)
 {
-   /*Confirms positions. Did he really crossed the line and it's the worst cyclist in the race?*/
-   if((new_position == 0) && (cyclist->place == cyclists_competing))
+   int k, other;
+   for(k = peloton.place[cyclist]; k < standings.competing; k++)
    {
-      pthread_mutex_lock(&elimination_lock);
-         if(already_eliminated == 0)
-         {
-            already_eliminated = 1;
-            mark_cyclist(cyclist, 'E');
-         }
-      pthread_mutex_unlock(&elimination_lock);
+      other = standings.rank[k];
+      standings.rank[k - 1] = other;
+      peloton.place[other] = k;
    }
+   peloton.place[cyclist] = standings.competing--;
+}
+
+/*Returns the cyclist in the place "place"*/
+int standings_rank(int place)
+{
+   return standings.rank[place - 1];
+}
+
+/*Eliminates the worst cyclist of the lap*/
+void eliminate_cyclist(int cyclist)
+{
+   int nobody = 0, eliminated = 0;
+
+   /*He just crossed the line (see new_lap()). Is he the worst cyclist in the race? Nobody else is eliminated until he left the race.
+   The last place is read, and he leaves it, under the lock of the standings: the cyclists moving in parallel change them*/
+   if(!serial_moves) LOCK(&standings.lock, PROBE_STANDINGS);
+      if(standings.rank[standings.competing - 1] == cyclist && __atomic_compare_exchange_n(&race.eliminated, &nobody, cyclist + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+      {
+         __atomic_fetch_or(&peloton.status[cyclist], ELIMINATED, __ATOMIC_SEQ_CST);
+         standings_drop(cyclist);
+         eliminated = 1;
+      }
+   if(!serial_moves) pthread_mutex_unlock(&standings.lock);
+   if(eliminated) log_event(EVENT_ELIMINATION, cyclist, EMPTY);
+}
+
+/*The cyclist left the race: if he was the cyclist eliminated, another one can be*/
+void release_elimination(int cyclist)
+{
+   int eliminated = cyclist + 1;
+   __atomic_compare_exchange_n(&race.eliminated, &eliminated, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+/*Returns the number of cyclists still competing*/
+int cyclists_competing()
+{
+   return __atomic_load_n(&race.competing, __ATOMIC_ACQUIRE);
 }
 
 /*Marks the cyclist to be eliminated from the competition*/
-void mark_cyclist(Cyclist *cyclist, char mark)
+void mark_cyclist(int cyclist, char mark)
 {
    /*Marks the cyclists to eliminate him later*/
-   if(mark == 'E') cyclist->eliminated = 'Y';
-   else /*mark == 'B'*/ cyclist->broken = 'Y';
+   /*Atomic, as another cyclist may be setting CAUGHT*/
+   if(mark == 'E') __atomic_fetch_or(&peloton.status[cyclist], ELIMINATED, __ATOMIC_SEQ_CST);
+   else /*mark == 'B'*/ __atomic_fetch_or(&peloton.status[cyclist], BROKEN, __ATOMIC_SEQ_CST);
+   /*He is not in the standings anymore*/
+   standings_remove(cyclist);
 }
 
-/*Checks is the cyclist in this position will complete a new lap*/
-int lap_complete(int position)
+/*Checks if the cyclist moving from old_position to new_position completes a new lap: he crosses the line at the meter 0*/
+int lap_complete(int old_position, int new_position)
 {
-   if(0 == position) return 1;
+   if(new_position < old_position) return 1;
    return 0;
 }
 
 /*Attempts to change cyclist speed*/
-int roll_speed() 
+int roll_speed(int cyclist) 
 {
-  return ((rand() % 2) + 1) * 25; 
+  return (rng_below(&peloton.rng[cyclist], 2) + 1) * 25; 
 }
 
-/*Rolls a number, where this number is the position of a cyclist in the race. This number determines who will suffer a break attempt*/
-int roll_cyclist_to_try_to_break()
+/*Rolls a number, where this number is the position of a cyclist in the race. Returns the cyclist in this position: he will suffer a break attempt.
+The number is rolled with the stream of the cyclist that asked for it (the leader), and the place is read under the lock of the standings*/
+int roll_cyclist_to_try_to_break(int cyclist)
 {
-   return ((rand() % cyclists_competing) + 1);  
+   int place = rng_below(&peloton.rng[cyclist], cyclists_competing()) + 1, rolled;
+
+   if(!serial_moves) LOCK(&standings.lock, PROBE_STANDINGS);
+      rolled = standings_rank(place);
+   if(!serial_moves) pthread_mutex_unlock(&standings.lock);
+   return rolled;
 }
 
-/*Writes the cyclists in the new track position*/
-void write_cyclist(Cyclist *cyclist, int new_position)
+/*Seeds the random stream "stream" of the generator*/
+void rng_seed(Rng *rng, unsigned long seed, unsigned long stream)
 {
-   if(track[new_position].cyclist1 == NULL) track[new_position].cyclist1 = cyclist;
-   else if(track[new_position].cyclist2 == NULL) track[new_position].cyclist2 = cyclist;
-   else if(track[new_position].cyclist3 == NULL) track[new_position].cyclist3 = cyclist;
-   else track[new_position].cyclist4 = cyclist;
-   (track[new_position].cyclists)++;
-   if(track[new_position].cyclists > MAX_CYCLISTS) 
-   {
-      printf("\nError. Found more than 4 cyclists in track[%d].\n", new_position);
-      exit(0);
-   }
+   rng->state = 0;
+   rng->inc = ((uint64_t)stream << 1) | 1;
+   rng_next(rng);
+   rng->state += seed;
+   rng_next(rng);
+}
+
+/*Returns the next random number of the stream*/
+uint32_t rng_next(Rng *rng)
+{
+   uint64_t old_state = rng->state;
+   uint32_t xorshifted, rotation;
+
+   rng->state = old_state * 6364136223846793005UL + rng->inc;
+   xorshifted = (uint32_t)(((old_state >> 18) ^ old_state) >> 27);
+   rotation = (uint32_t)(old_state >> 59);
+   return (xorshifted >> rotation) | (xorshifted << ((32 - rotation) & 31));
+}
+
+/*Returns a random number in [0...n-1]*/
+int rng_below(Rng *rng, int n)
+{
+   return (int)(((uint64_t)rng_next(rng) * (uint64_t)n) >> 32);
+}
+
+/*Writes the cyclists in the new track position, in the field he reserved*/
+void write_cyclist(int cyclist, int new_position, int field)
+{
+   __atomic_store_n(&find_meter(METER(new_position))->cyclist[field], cyclist + 1, __ATOMIC_RELEASE);
    /*Assigns the new position to the cyclist*/
-   cyclist->position = new_position;
+   peloton.position[cyclist] = new_position;
 }
 
 /*Erases the cyclists from his old track position*/
-void erase_cyclist(Cyclist *cyclist, int old_position)
+void erase_cyclist(int cyclist, int old_position)
 {
-   if(track[old_position].cyclist1 == cyclist) track[old_position].cyclist1 = NULL;
-   else if(track[old_position].cyclist2 == cyclist) track[old_position].cyclist2 = NULL;
-   else if(track[old_position].cyclist3 == cyclist) track[old_position].cyclist3 = NULL;
-   else track[old_position].cyclist4 = NULL;
-   (track[old_position].cyclists)--;
-   if(track[old_position].cyclists < NO_CYCLISTS) 
+   int field, meter = METER(old_position);
+   Meter *cell = find_meter(meter);
+   for(field = 0; field < MAX_CYCLISTS && cell->cyclist[field] != cyclist + 1; field++) continue;
+   if(field == MAX_CYCLISTS) 
    {
-      printf("\nError. Found negative number of cyclists in track[%d].\n", old_position);
+      printf("\nError. Cyclist #%d not found in track[%d].\n", peloton.number[cyclist], meter);
       exit(0);
    }
+   __atomic_store_n(&cell->cyclist[field], FREE_FIELD, __ATOMIC_RELEASE);
+   release_field(meter, field);
+}
+
+/*Reserves a free field of the meter for a cyclist. Returns the field, or EMPTY if the meter is full and wait is 0. If wait is 1, waits for a free field*/
+int reserve_field(int meter, int wait)
+{
+   Meter *cell = claim_meter(meter);
+   unsigned int occupancy = __atomic_load_n(&cell->occupancy, __ATOMIC_ACQUIRE);
+   int field;
+
+   /*Nobody else writes the track: the field is just taken*/
+   if(serial_moves)
+   {
+      if(occupancy == FULL) return EMPTY;
+      for(field = 0; occupancy & (1u << field); field++) continue;
+      cell->occupancy = occupancy | (1u << field);
+      return field;
+   }
+   while(1)
+   {
+      if(occupancy == FULL)
+      {
+         if(!wait) return EMPTY;
+         PROBE_BEGIN(PROBE_FIELD_WAIT);
+         /*Parks on the occupancy of the meter until a field is released (see release_field())*/
+         while((occupancy = __atomic_load_n(&cell->occupancy, __ATOMIC_ACQUIRE)) == FULL) futex_wait(&cell->occupancy, FULL);
+         PROBE_END(PROBE_FIELD_WAIT);
+         continue;
+      }
+      /*Lowest free field*/
+      for(field = 0; occupancy & (1u << field); field++) continue;
+      /*On failure occupancy is reloaded with the current value of the meter*/
+      if(__atomic_compare_exchange_n(&cell->occupancy, &occupancy, occupancy | (1u << field), 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) return field;
+   }
+}
+
+/*Frees a field of the meter. The slot of a sparse meter left empty is freed at the end of the tick.
+In the thread engine, cyclists may be parked on a full meter (see reserve_field()): they are woken when it stops being full*/
+void release_field(int meter, int field)
+{
+   Meter *cell = find_meter(meter);
+   unsigned int left, old;
+
+   if(serial_moves) left = cell->occupancy &= ~(1u << field);
+   else 
+   {
+      old = __atomic_fetch_and(&cell->occupancy, ~(1u << field), __ATOMIC_RELEASE);
+      left = old & ~(1u << field);
+      if(old == FULL && engine == THREAD_ENGINE) futex_wake(&cell->occupancy);
+   }
+   if(sparse && left == 0) sparse_track.vacated[__atomic_fetch_add(&sparse_track.vacancies, 1, __ATOMIC_RELAXED)] = meter;
+}
+
+/*Sleeps while *word is value. The kernel checks the value when it puts the thread to sleep, so a wake in between is not lost*/
+void futex_wait(unsigned int *word, unsigned int value)
+{
+   if(syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0) < 0 && errno != EAGAIN && errno != EINTR)
+   {
+      printf("\nFutex wait failed.\n");
+      exit(1);
+   }
+}
+
+/*Wakes every thread sleeping on *word*/
+void futex_wake(unsigned int *word)
+{
+   syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/*Returns the number of cyclists in the meter*/
+int cyclists_in(int meter)
+{
+   return __builtin_popcount(__atomic_load_n(&find_meter(meter)->occupancy, __ATOMIC_ACQUIRE));
+}
+
+/*Decides the next position of a single cyclist (thread engine)*/
+int decide_new_position(int cyclist)
+{
+   plan_moves(cyclist, cyclist + 1);
+   return intent[cyclist];
 }
 
-/*Decides the next position considering speed and index in track*/
-int decide_new_position(Cyclist *cyclist)
+/*Updates the speed of the cyclists [first...last-1] and decides their new positions (intent). See the speed profiles.
+Drafting is read from the track first. The other loops only do arithmetic on the arrays of the peloton, without branches or calls, 
+and the arrays never overlap (ivdep), so the compiler vectorizes them*/
+void plan_moves(int first, int last)
 {
-   /*Updates half field of the cyclist*/
-   if(cyclist->speed == 25)
+   int *position = peloton.position, *velocity = peloton.velocity, *speed = peloton.speed, *lap = peloton.lap;
+   int *accel = peloton.accel, *fatigue = peloton.fatigue, *draft = peloton.draft, *next = intent;
+   int i, top, v, lap_length = POSITION_UNITS * track_size;
+
+   for(i = first; i < last; i++)
+      draft[i] = cyclists_in(METER(position[i]) + 1 < track_size ? METER(position[i]) + 1 : 0) > 0;
+
+#pragma GCC ivdep
+   for(i = first; i < last; i++)
+   {
+      top = TOP_SPEED(speed[i], draft[i], fatigue[i], lap[i]);
+      velocity[i] = PACE(velocity[i], accel[i], top);
+   }
+
+#pragma GCC ivdep
+   for(i = first; i < last; i++)
    {
-      if(cyclist->half == 0) cyclist->half = 0.5;
-      else cyclist->half = 0;
+      v = position[i] + velocity[i];
+      next[i] = v - (v >= lap_length) * lap_length;
    }
+}
+
+/*Reserves a field in the farthest meter with room between old_position and *new_position, at least nearest meters ahead of old_position. 
+A cyclist that can not reach his new meter stops at the end of that one: *new_position is set to it. Returns the field, or EMPTY if every meter is full*/
+int reserve_on_the_way(int old_position, int *new_position, int nearest)
+{
+   int from = METER(old_position), span = METER(*new_position) - from, k, field;
 
-   if((cyclist->speed == 25 && cyclist->half == 0) || cyclist->speed == 50)
+   if(span < 0) span += track_size;
+   for(k = span; k >= nearest; k--)
    {
-      if(cyclist->position == track_size-1) return 0;
-      return cyclist->position + 1;
+      field = reserve_field((from + k) % track_size, 0);
+      if(field == EMPTY) continue;
+      if(k < span) *new_position = ((from + k) % track_size) * POSITION_UNITS + POSITION_UNITS - 1;
+      return field;
    }
-   return cyclist->position;
+   return EMPTY;
 }
 
 /*Confirms if the cyclists is out*/
-int disqualified(Cyclist *cyclist)
+int disqualified(int cyclist)
 {
-   if(cyclist->eliminated == 'Y' || cyclist->broken == 'Y') return 1;
+   if(peloton.status[cyclist] & OUT) return 1;
    return 0;
 }
 
 /*Broadcasts, announcing broken, and eliminated cyclists and the winner of the race*/
-void broadcast(Cyclist *cyclist)
+void broadcast(int cyclist)
+{
+#if FINISH_LAPS
+   /*The cyclists that finish are announced once they are placed (see classify())*/
+   if(!disqualified(cyclist)) return;
+#endif
+   announce(cyclist);
+}
+
+/*Announces a cyclist that left the race*/
+void announce(int cyclist)
 {
-   int sec = cyclist->cyclist_timer / CLOCKS_PER_SEC;
-   if(cyclist->eliminated == 'Y')
-      printf("\n*****************************\nThe cyclist %d (%p) has been ELIMINATED (time: %ds). Place: %d\n*****************************\n", cyclist->number, (void*)cyclist, sec, cyclist->place);
-   else if(cyclist->broken == 'Y')
-      printf("\n*****************************\nThe cyclist %d (%p) has BROKEN (time: %ds). Place: %d\n*****************************\n", cyclist->number, (void*)cyclist, sec, cyclist->place);
+   int sec = peloton.cyclist_timer[cyclist] / CLOCKS_PER_SEC;
+   if(quiet) return;
+   if(peloton.status[cyclist] & ELIMINATED)
+      printf("\n*****************************\nThe cyclist %d has been ELIMINATED (time: %ds). Place: %d\n*****************************\n", peloton.number[cyclist], sec, peloton.place[cyclist]);
+   else if(peloton.status[cyclist] & BROKEN)
+      printf("\n*****************************\nThe cyclist %d has BROKEN (time: %ds). Place: %d\n*****************************\n", peloton.number[cyclist], sec, peloton.place[cyclist]);
+   else if(peloton.place[cyclist] == 1)
+      printf("\n*****************************\nThe cyclist %d has WON THE RACE (time: %ds). Place: %d\n*****************************\n", peloton.number[cyclist], sec, peloton.place[cyclist]);
    else
-      printf("\n*****************************\nThe cyclist %d (%p) has WON THE RACE (time: %ds). Place: %d\n*****************************\n", cyclist->number, (void*)cyclist, sec, cyclist->place);
+      printf("\n*****************************\nThe cyclist %d has FINISHED THE RACE (time: %ds). Place: %d\n*****************************\n", peloton.number[cyclist], sec, peloton.place[cyclist]);
 }
 
 /*Omnium race function. Each thread is representing a cyclist in omnium*/
 void *omnium(void *args)
 {
-   int new_position, old_position;
-   Cyclist *cyclist = ((Cyclist*) args);
+   int new_position, old_position, field = 0;
+   int cyclist = (int)(long) args;
 
-   old_position = cyclist->position;
-   while(!go) continue;
+   old_position = peloton.position[cyclist];
+   wait_for_start();
 
-   for(new_position = decide_new_position(cyclist); cyclists_competing != 1; new_position = decide_new_position(cyclist)) 
+   for(new_position = decide_new_position(cyclist); !RACE_OVER; new_position = decide_new_position(cyclist)) 
    {
-      if(old_position != new_position) 
+      if(METER(old_position) != METER(new_position)) 
       {
-         sem_wait(&track[new_position].mutex);
-         critical_section(cyclist, old_position, new_position);
-         sem_post(&track[old_position].mutex);
-         old_position = new_position;
+         field = reserve_on_the_way(old_position, &new_position, 1);
+         /*Every meter ahead is full: waits for room in the next one*/
+         if(field == EMPTY)
+         {
+            new_position = ((METER(old_position) + 1) % track_size) * POSITION_UNITS + POSITION_UNITS - 1;
+            field = reserve_field(METER(new_position), 1);
+         }
+         critical_section(cyclist, old_position, new_position, field);
       }
+      /*Ahead, in the same meter*/
+      else peloton.position[cyclist] = new_position;
+      old_position = new_position;
       if(disqualified(cyclist) == 1) break;
-      await(72000000); /*Each cyclist make a move every 0.72ms. 1m or 0.5m, depending on his speed*/
+      await(CYCLE_NSEC); /*Each cyclist make a move every 0.72ms, as far as his speed takes him*/
    }
 
-   sem_post(&track[new_position].mutex);
+   /*Gives back the field he reserved but never wrote himself in*/
+   if(disqualified(cyclist)) release_field(METER(new_position), field);
    broadcast(cyclist);
-
-   pthread_mutex_lock(&elimination_lock);
-      already_eliminated = 0;
-   pthread_mutex_unlock(&elimination_lock);
+   release_elimination(cyclist);
 
    return NULL;
 }
@@ -471,119 +1547,100 @@ void *omnium(void *args)
 void *omnium_chronometer(void *args)
 {
    int cycles = 0;
-   Cyclist *all_cyclists = args;
+   struct timespec deadline;
 
-   /*Race will start. After countdown(), all cyclist threads will be unlocked.*/
+   /*Race will start. After countdown(), all cyclist threads will be unlocked. It also starts the race chronometer*/
    countdown();
-   /*RELEASE THE CYCLISTS!*/
-   /*Race chronometer*/
-   start_timer = clock();
-   
-   /*Time thread will run until we have just 1 cyclist competing*/
-   while(cyclists_competing != 1)
-   {
-      /*Simulation timer, counted in cycles of 0.72ms*/
-      await(72000000);
-      /*Update places in case of a break*/
-      update_timers(all_cyclists);
-      if(update == 1) update_places(all_cyclists);
+   /*In lockstep and segment mode the workers run the chronometer themselves, at the end of each tick (see lockstep_chronometer())*/
+   if(engine != THREAD_ENGINE) return NULL;
+
+   /*Time thread will run until we have just 1 cyclist competing.
+   Simulation timer, counted in cycles of 0.72ms. Each cycle ends at a fixed deadline, so the time spent updating the timers does not add up*/
+   clock_gettime(CLOCK_REALTIME, &deadline);
+   while(wait_for_cycle(&deadline))
+   {
+      ticks++;
+#ifdef INSTRUMENT
+      check_dump_request();
+#endif
+      update_timers();
+      if(streaming) sample_telemetry();
       /*DEBUG MODE*/
       if(mode == 'U' || mode == 'V') 
       { 
-         if(cycles % 20 == 0) { cycles = 0; print_cyclists(all_cyclists); }  
+         if(cycles % debug_every == 0) { cycles = 0; submit_frame(); }  
          cycles++;
       }
    }
    return NULL;
 }
 
+/*Writes the events of the race in the binary log, in batches. racelog renders the text log from it*/
 void *omnium_logger(void *args)
 {
    FILE *pfile;
-   int i, lap = 1, special_position = track_size, order[3];
-   char str[256];
-   Cyclist *all_cyclists = args;
+   LogHeader header;
+   RaceEvent *batch;
+   int n = 0, closed = 0;
    
-   pfile = fopen("output/race.log", "w");
-
-   /*Writes the first lap in the output*/
-   fputs("OMNIUM LOG (Mode = ", pfile); fputc(mode, pfile); fputs("):\n\n", pfile);
-
-   while(cyclists_competing != 1)
+   /*A resumed race goes on with the log of the race, without the events that happened after the snapshot*/
+   if(resume_file != NULL) 
    {
-      pthread_mutex_lock(&track[special_position].meter_lock);
-      /*Writes info in the log: eliminated cyclists and the remaining last 2 cyclists. Also, writed next lap info.*/
-      if(track[special_position].cyclist1 != NULL && track[special_position].cyclist2 != NULL && track[special_position].cyclist3 != NULL)
+      pfile = fopen("output/race.bin", "r+b");
+      if(pfile == NULL || fseek(pfile, 0, SEEK_END) != 0 || ftell(pfile) < (long)(sizeof(header) + logged_events * sizeof(RaceEvent)))
       {
-         int eliminated_place = (*track[special_position].cyclist3).place; 
-
-         fputs("LOSERS OF LAP ", pfile);
-         sprintf(str, "%d", lap++); fputs(str, pfile);
-         fputs(":\n", pfile);
-
-         fputs("Cyclist #", pfile);
-         sprintf(str, "%d", (*track[special_position].cyclist1).number); fputs(str, pfile);
-         fputs(" has terminated this lap in position ", pfile);
-         sprintf(str, "%d", eliminated_place - 2); fputs(str, pfile);
-         fputs(" of ", pfile);
-         sprintf(str, "%d", total_cyclists); fputs(str, pfile); 
-         fputs(".\n", pfile);
-
-         fputs("Cyclist #", pfile);
-         sprintf(str, "%d", (*track[special_position].cyclist2).number); fputs(str, pfile);
-         fputs(" has terminated this lap in position ", pfile);
-         sprintf(str, "%d", eliminated_place - 1); fputs(str, pfile);
-         fputs(" of ", pfile);
-         sprintf(str, "%d", total_cyclists); fputs(str, pfile); 
-         fputs(".\n", pfile);
-
-         fputs("Cyclist #", pfile);
-         sprintf(str, "%d", (*track[special_position].cyclist3).number); fputs(str, pfile);
-         fputs(" has terminated this lap in position ", pfile);
-         sprintf(str, "%d", eliminated_place); fputs(str, pfile);
-         fputs(" of ", pfile);
-         sprintf(str, "%d", total_cyclists); fputs(str, pfile); 
-         fputs(". -> ELIMINATED.\n", pfile);
-
-         track[special_position].cyclist1 = NULL;
-         track[special_position].cyclist2 = NULL;
-         track[special_position].cyclist3 = NULL;
-         track[special_position].cyclists -= 3;  
+         printf("\nThe binary log output/race.bin is missing events of the snapshot.\n");
+         exit(1);
       }
-      /*Writes info in the log: broken cyclist*/
-      if(track[special_position].cyclist4 != NULL)
+      if(ftruncate(fileno(pfile), sizeof(header) + logged_events * sizeof(RaceEvent)) != 0 || fseek(pfile, 0, SEEK_END) != 0)
       {
-         fputs("KNOCKED OUT IN LAP ", pfile);
-         sprintf(str, "%d", lap); fputs(str, pfile);
-         fputs(":\n", pfile);
-
-         fputs("Cyclist #", pfile);
-         sprintf(str, "%d", (*track[special_position].cyclist4).number); fputs(str, pfile);
-         fputs(" has been knocked out. His final standing is ", pfile);
-         sprintf(str, "%d", (*track[special_position].cyclist4).place); fputs(str, pfile);
-         fputs(" of ", pfile);
-         sprintf(str, "%d", total_cyclists); fputs(str, pfile); 
-         fputs(". -> BROKEN.\n", pfile);
-
-         track[special_position].cyclist4 = NULL;
-         (track[special_position].cyclists)--;
+         printf("\nCould not truncate output/race.bin.\n");
+         exit(1);
       }
-      pthread_mutex_unlock(&track[special_position].meter_lock);
    }
-
-   for(i = 0; i < total_cyclists; i++)
+   else
    {
-      if(all_cyclists[i].place == 1) order[0] = i;
-      if(all_cyclists[i].place == 2) order[1] = i;
-      if(all_cyclists[i].place == 3) order[2] = i;
+      pfile = fopen("output/race.bin", "wb");
+      if(pfile == NULL)
+      {
+         printf("\nCould not open output/race.bin.\n");
+         exit(1);
+      }
+      memset(&header, 0, sizeof(header));
+      strcpy(header.magic, LOG_MAGIC);
+      header.version = LOG_VERSION;
+      header.mode = mode;
+      header.total_cyclists = total_cyclists;
+      header.track_size = track_size;
+      header.rules = RULES;
+      fwrite(&header, sizeof(header), 1, pfile);
    }
+   batch = malloc(EVENT_BATCH * sizeof(RaceEvent));
 
-   /*Writes the winners*/
-   fputs("\n\nOMNIUM WINNERS:\n", pfile);
-   fputs("\n1st place: Cyclist #", pfile); sprintf(str, "%d", all_cyclists[order[0]].number); fputs(str, pfile); fputc('.', pfile);
-   fputs("\n2nd place: Cyclist #", pfile); sprintf(str, "%d", all_cyclists[order[1]].number); fputs(str, pfile); fputc('.', pfile);
-   fputs("\n3rd place: Cyclist #", pfile); sprintf(str, "%d", all_cyclists[order[2]].number); fputs(str, pfile); fputc('.', pfile);
+   /*Runs until the ring is closed and empty. closed is read before the ring, so no event published before the closing is lost.
+   A closed ring may still hold more than a batch: only an empty read ends it*/
+   while(1)
+   {
+      closed = __atomic_load_n(&events.closed, __ATOMIC_ACQUIRE);
+      while(n < EVENT_BATCH && consume_event(&batch[n])) n++;
+      if(n == 0) 
+      {
+         if(closed) break;
+         wait_for_events();
+         continue;
+      }
+      wake_producers();
+      fwrite(batch, sizeof(RaceEvent), n, pfile);
+      /*A snapshot is only written once the events before it are in the file (see write_snapshot())*/
+      if(snapshot_every > 0) 
+      {
+         fflush(pfile);
+         __atomic_add_fetch(&flushed_events, n, __ATOMIC_RELEASE);
+      }
+      n = 0;
+   }
 
+   free(batch);
    fclose(pfile);
 
    return NULL;
@@ -608,112 +1665,327 @@ void countdown()
 {
    int i;
 
-   printf("\nOmnium will start in 5 seconds!\n\n");
-   for(i = 5; i >= 2; i--)
+   if(!quiet) 
    {
-      sleep(1);
-      printf("%d...\n", i);
+      printf("\nOmnium will start in 5 seconds!\n\n");
+      for(i = 5; i >= 2; i--)
+      {
+         rest(1);
+         printf("%d...\n", i);
+      }
+      rest(1);
+      printf("GO!\n\n");
    }
-   sleep(1);
-   printf("GO!\n\n");
-   go = START;
+   /*Race chronometer. Started before the cyclists are released, so no cycle is counted before it*/
+   clock_gettime(CLOCK_MONOTONIC, &start_timer);
+   /*RELEASE THE CYCLISTS!*/
+   pthread_mutex_lock(&race_lock);
+      go = START;
+      pthread_cond_broadcast(&start_signal);
+   pthread_mutex_unlock(&race_lock);
 }
 
-/*Allocates the track*/
-void make_track()
+/*Blocks a cyclist (or a lockstep worker) until countdown() gives the start*/
+void wait_for_start()
 {
-   int i;
-   track = malloc((track_size + 1) * sizeof(Meter));
-   /*Note: the last position of track is used ONLY by the logger. It is not a real meter. Is just contains information to write the output*/
-   for(i = 0; i <= track_size; i++)
-   {
-      track[i].cyclist1 = NULL;
-      track[i].cyclist2 = NULL;
-      track[i].cyclist3 = NULL;
-      track[i].cyclist4 = NULL;
-      track[i].cyclists = 0;
-      if (pthread_mutex_init(&track[i].meter_lock, NULL) != 0)
-      {
-         printf("\n mutex init failed\n");
-         exit(1);
-      }
-      if (sem_init(&track[i].mutex, 0, 4)) 
-      {
-         printf("Erro ao criar o semáforo :(\n");
-         exit(2);
-      }
-   }
+   pthread_mutex_lock(&race_lock);
+      while(!go) pthread_cond_wait(&start_signal, &race_lock);
+   pthread_mutex_unlock(&race_lock);
 }
 
-/*Add all the attributes to the cyclists.*/
-void make_cyclists(Cyclist *thread_args, int *initial_config, int initial_speed, int cyclists)
+/*Moves the deadline one cycle ahead and sleeps until it. Returns 0 without waiting the whole cycle if the race is over*/
+int wait_for_cycle(struct timespec *deadline)
 {
-   int i;
-   for(i = 0; i < cyclists; i++)
+   int running;
+
+   deadline->tv_nsec += CYCLE_NSEC;
+   if(deadline->tv_nsec >= 1000000000L)
    {
-      thread_args[i].number = initial_config[i];
-      thread_args[i].position = i; /*At the start of the race, all cyclists starts with 1m space of each other independent of the mode*/
-      thread_args[i].place = cyclists - i;
-      thread_args[i].speed = initial_speed;
-      thread_args[i].lap = 1; /*first lap*/
-      thread_args[i].eliminated = 'N';
-      thread_args[i].broken = 'N';
-      thread_args[i].half = 0;
+      deadline->tv_sec++;
+      deadline->tv_nsec -= 1000000000L;
    }
+   pthread_mutex_lock(&race_lock);
+      while((running = !RACE_OVER) && pthread_cond_timedwait(&finish_signal, &race_lock, deadline) != ETIMEDOUT) continue;
+   pthread_mutex_unlock(&race_lock);
+   return running;
 }
 
-/*Assigns cyclists to track positions in the beginning of the simulation*/
-void put_cyclists_in_track(Cyclist *thread_args, int cyclists)
+/*Called when the number of cyclists competing drops to 1: wakes the chronometer*/
+void finish_race()
 {
-   int i;
-   for(i = 0; i < cyclists; i++)
+   pthread_mutex_lock(&race_lock);
+      pthread_cond_broadcast(&finish_signal);
+   pthread_mutex_unlock(&race_lock);
+}
+
+/*Allocates the track. It is the first allocation of the arena, so it starts at a huge page boundary.
+The arena is zero, so every meter is already empty: the pages of the track are touched only when a cyclist first gets there, by the worker moving him.
+A sparse track takes memory for its cyclists only, whatever the size of the track*/
+void make_track()
+{
+   if(sparse)
    {
-      track[i].cyclist1 = &thread_args[i];
-      track[i].cyclists = 1;
-      sem_wait(&track[i].mutex);
+      sparse_track.slots = arena_alloc(sparse_slots(total_cyclists) * sizeof(Slot));
+      sparse_track.mask = sparse_slots(total_cyclists) - 1;
+      sparse_track.vacated = arena_alloc(2 * total_cyclists * sizeof(int));
+      sparse_track.vacancies = 0;
+      track = NULL;
    }
+   else track = arena_alloc(track_size * sizeof(Meter));
 }
 
-/*Returns an array with the competitors configured in an aleatory order*/
-int *initial_configuration(int max_cyclists)
+/*Returns the number of slots of the sparse track of a race of cyclists cyclists: a power of 2, with SPARSE_SLOTS slots per cyclist or more*/
+unsigned int sparse_slots(int cyclists)
 {
-   int *initial_config;
-
-   initial_config = malloc( max_cyclists * sizeof(int) );
-   srand(time(NULL));
-   set_cyclists(initial_config, 0, 0, max_cyclists, max_cyclists);
-
-   return initial_config;
+   unsigned int slots = MIN_SLOTS;
+   while(slots < (unsigned int)cyclists * SPARSE_SLOTS) slots *= 2;
+   return slots;
 }
 
-/*Organize the cyclists by their number in a random order*/
-int set_cyclists(int *initial_config, int pos, int p, int r, int size)
+/*Returns the meter to read. A meter the sparse track does not have is empty: it is empty_meter, which is never written*/
+Meter *find_meter(int meter)
 {
-   int q;
+   unsigned int slot, key;
 
-   if(p == 0) {
-      if(r != 0) q = (rand() % r);
-      else q = r;  
+   if(!sparse) return &track[meter];
+   for(slot = (unsigned int)meter * METER_HASH & sparse_track.mask; ; slot = (slot + 1) & sparse_track.mask)
+   {
+      key = __atomic_load_n(&sparse_track.slots[slot].key, __ATOMIC_ACQUIRE);
+      if(key == (unsigned int)meter + 1) return &sparse_track.slots[slot].meter;
+      if(key == 0) return (Meter*)&empty_meter;
    }
-   else {
-      if(p != r) q = p + (rand() % (r - p));
-      else q = r;
-   } 
+}
+
+/*Returns the meter to write, claiming a slot of the sparse track for it if it has none. A claimed meter is empty (it is zero)*/
+Meter *claim_meter(int meter)
+{
+   unsigned int slot, key, free_key;
+
+   if(!sparse) return &track[meter];
+   for(slot = (unsigned int)meter * METER_HASH & sparse_track.mask; ; slot = (slot + 1) & sparse_track.mask)
+   {
+      key = __atomic_load_n(&sparse_track.slots[slot].key, __ATOMIC_ACQUIRE);
+      /*On failure key is reloaded: another worker took the slot, maybe for this meter*/
+      free_key = 0;
+      if(key == 0 && __atomic_compare_exchange_n(&sparse_track.slots[slot].key, &free_key, (unsigned int)meter + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) 
+         return &sparse_track.slots[slot].meter;
+      if(key == 0) key = free_key;
+      if(key == (unsigned int)meter + 1) return &sparse_track.slots[slot].meter;
+   }
+}
+
+/*Returns the slot of the meter in the sparse track, or EMPTY if it has none*/
+long find_slot(int meter)
+{
+   unsigned int slot;
+
+   for(slot = (unsigned int)meter * METER_HASH & sparse_track.mask; sparse_track.slots[slot].key != 0; slot = (slot + 1) & sparse_track.mask)
+      if(sparse_track.slots[slot].key == (unsigned int)meter + 1) return slot;
+   return EMPTY;
+}
+
+/*Frees the slots of the meters left empty in this tick. Runs between two ticks, alone: the slots after a freed one are shifted back, 
+so every meter stays reachable from its hash without probing over a hole*/
+void free_vacated_meters()
+{
+   long hole, next, home;
+   int i;
+
+   for(i = 0; i < sparse_track.vacancies; i++)
+   {
+      /*The meter may have been taken again after it was left (or freed already)*/
+      hole = find_slot(sparse_track.vacated[i]);
+      if(hole == EMPTY || sparse_track.slots[hole].meter.occupancy != 0) continue;
+      next = hole;
+      while(1)
+      {
+         next = (next + 1) & sparse_track.mask;
+         if(sparse_track.slots[next].key == 0) break;
+         home = (sparse_track.slots[next].key - 1) * METER_HASH & sparse_track.mask;
+         /*A meter stays where it is if its home is cyclically in (hole, next]*/
+         if(hole <= next ? (hole < home && home <= next) : (hole < home || home <= next)) continue;
+         sparse_track.slots[hole] = sparse_track.slots[next];
+         hole = next;
+      }
+      memset(&sparse_track.slots[hole], 0, sizeof(Slot));
+   }
+   sparse_track.vacancies = 0;
+}
+
+/*Empties the track of a new race (but for the meters of the starting grid, which are the only ones written)*/
+void clear_track()
+{
+   int i;
+   if(sparse) memset(sparse_track.slots, 0, (sparse_track.mask + 1) * sizeof(Slot));
+   else for(i = 0; i < total_cyclists; i++) memset(&track[START_METER(i)], 0, sizeof(Meter));
+}
+
+/*Maps the arena of a race of cyclists cyclists*/
+void make_arena(int cyclists)
+{
+   size_t capacity = arena_size(cyclists);
+
+   /*A server job keeps the arena of its last race (see destroy_arena()), unless this race needs a bigger one*/
+   if(arena.memory != NULL)
+   {
+      arena.used = 0;
+      if(capacity <= arena.capacity) return;
+      munmap(arena.memory, arena.size);
+   }
+   /*A huge page more than needed, to align base*/
+   arena.size = capacity + HUGE_PAGE;
+   arena.memory = mmap(NULL, arena.size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if(arena.memory == MAP_FAILED)
+   {
+      printf("\nArena allocation failed (%lu bytes).\n", (unsigned long)arena.size);
+      exit(1);
+   }
+   arena.base = arena.memory + (HUGE_PAGE - (uintptr_t)arena.memory % HUGE_PAGE) % HUGE_PAGE;
+   arena.used = 0;
+   arena.capacity = capacity;
+#ifdef MADV_HUGEPAGE
+   /*Only a hint: without transparent huge pages the arena gets normal pages*/
+   madvise(arena.base, capacity, MADV_HUGEPAGE);
+#endif
+}
+
+/*Returns the bytes of the arena of a race of cyclists cyclists: everything make_arena's callers allocate, rounded to ARENA_ALIGN.
+The workers and the segments are both counted, whatever the engine: unused bytes of the arena are never touched, so they cost no memory*/
+size_t arena_size(int cyclists)
+{
+   size_t n = cyclists, k = workers;
+   return (sparse ? ARENA_ROUND(sparse_slots(cyclists) * sizeof(Slot)) + ARENA_ROUND(2 * n * sizeof(int)) : ARENA_ROUND(track_size * sizeof(Meter)))
+        + ARENA_ROUND(EVENT_RING_SIZE * sizeof(EventCell))
+        + ARENA_ROUND(n * sizeof(pthread_t))
+        + 17 * ARENA_ROUND(n * sizeof(int))           /*Grid, position, place, speed, velocity, accel, fatigue, draft, lap, number, points, rank, intent, movers, next, contested and nearest*/
+        + ARENA_ROUND(sparse_slots(cyclists) * sizeof(Bucket))
+        + 2 * ARENA_ROUND(n * sizeof(char))           /*status and retired*/
+        + ARENA_ROUND(n * sizeof(clock_t))
+        + ARENA_ROUND(n * sizeof(Rng))
+        + ARENA_ROUND(n * sizeof(long))
+        + ARENA_ROUND(k * sizeof(Worker))
+        + ARENA_ROUND(k * sizeof(Segment))
+        + k * ARENA_ROUND(n * sizeof(int))            /*Rosters of the segments*/
+        + 8 * ARENA_ROUND(n * sizeof(int))            /*Cruise: position, velocity, draft, lap, place, field, shift and order*/
+        + 2 * ARENA_ROUND(n * sizeof(char))           /*status and retired*/
+        + ARENA_ROUND(CRUISE_EVENTS * sizeof(RaceEvent)); /*log*/
+}
+
+/*Returns size bytes of the arena, aligned to ARENA_ALIGN. They are zero*/
+void *arena_alloc(size_t size)
+{
+   void *memory = arena.base + arena.used;
+
+   size = ARENA_ROUND(size);
+   if(size > arena.capacity - arena.used)
+   {
+      printf("\nArena exhausted (%lu of %lu bytes used).\n", (unsigned long)arena.used, (unsigned long)arena.capacity);
+      exit(1);
+   }
+   arena.used += size;
+   return memory;
+}
+
+/*Frees everything allocated in the arena. A server job zeroes what the race used instead, and keeps the pages for its next race*/
+void destroy_arena()
+{
+   if(serving)
+   {
+      memset(arena.base, 0, arena.used);
+      arena.used = 0;
+      return;
+   }
+   munmap(arena.memory, arena.size);
+   arena.memory = NULL;
+}
+
+/*Add all the attributes to the cyclists.*/
+void make_cyclists(int *initial_config, int initial_speed, int cyclists)
+{
+   int i;
+   peloton.position = arena_alloc(cyclists * sizeof(int));
+   peloton.place = arena_alloc(cyclists * sizeof(int));
+   peloton.speed = arena_alloc(cyclists * sizeof(int));
+   peloton.velocity = arena_alloc(cyclists * sizeof(int));
+   peloton.accel = arena_alloc(cyclists * sizeof(int));
+   peloton.fatigue = arena_alloc(cyclists * sizeof(int));
+   peloton.draft = arena_alloc(cyclists * sizeof(int));
+   peloton.lap = arena_alloc(cyclists * sizeof(int));
+   peloton.status = arena_alloc(cyclists * sizeof(unsigned char));
+   peloton.cyclist_timer = arena_alloc(cyclists * sizeof(clock_t));
+   peloton.number = arena_alloc(cyclists * sizeof(int));
+   peloton.rng = arena_alloc(cyclists * sizeof(Rng));
+   peloton.points = arena_alloc(cyclists * sizeof(int));
+   for(i = 0; i < cyclists; i++)
+   {
+      peloton.number[i] = initial_config[i];
+      peloton.position[i] = POSITION_UNITS * START_METER(i); /*At the start of the race, all cyclists starts with 1m space of each other independent of the mode (or spread along the track)*/
+      peloton.place[i] = cyclists - i;
+      peloton.speed[i] = VELOCITY(initial_speed);
+      peloton.lap[i] = 1; /*first lap*/
+      peloton.status[i] = 0;
+      peloton.cyclist_timer[i] = 0;
+      rng_seed(&peloton.rng[i], seed, i + 1);
+      /*Standing start*/
+      peloton.velocity[i] = 0;
+      peloton.accel[i] = ACCEL_MIN + rng_below(&peloton.rng[i], ACCEL_MAX - ACCEL_MIN + 1);
+      peloton.fatigue[i] = rng_below(&peloton.rng[i], FATIGUE_MAX + 1);
+   }
+}
 
-   if(q <= r && p <= q)
+/*Assigns cyclists to track positions in the beginning of the simulation*/
+void put_cyclists_in_track(int cyclists)
+{
+   int i;
+   Meter *cell;
+   for(i = 0; i < cyclists; i++)
    {
-      if(pos < size) initial_config[pos++] = q + 1;
-      pos = set_cyclists(initial_config, pos, p, q - 1, size);
-      pos = set_cyclists(initial_config, pos, q + 1, r, size);
+      cell = claim_meter(START_METER(i));
+      cell->occupancy = 1;
+      cell->cyclist[0] = i + 1;
+   }
+}
+
+/*Returns an array with the competitors in their starting order (see grid). initial_config[max_cyclists-1] starts in the front*/
+int *initial_configuration(int max_cyclists)
+{
+   int *initial_config, i, end;
 
+   initial_config = arena_alloc( max_cyclists * sizeof(int) );
+   rng_seed(&grid_rng, seed, GRID_STREAM);
+   /*Ranked: the cyclist #1 in the front, the cyclist #max_cyclists in the back*/
+   for(i = 0; i < max_cyclists; i++) initial_config[i] = max_cyclists - i;
+   switch(grid)
+   {
+      case RANKED_GRID:
+         break;
+      case HEATS_GRID:
+         /*Heats from the front. The last one (in the back) may be smaller*/
+         for(end = max_cyclists; end > 0; end -= heat_size)
+         {
+            if(end > heat_size) shuffle_grid(initial_config + end - heat_size, heat_size);
+            else shuffle_grid(initial_config, end);
+         }
+         break;
+      default:
+         shuffle_grid(initial_config, max_cyclists);
    }
-   return pos;
+
+   return initial_config;
 }
 
-/*Prints cyclist information*/
-void print_cyclist(Cyclist cyclist)
+/*Puts the cyclists of the array in a random order, every order with the same probability (Fisher-Yates shuffle)*/
+void shuffle_grid(int *cyclists, int size)
 {
-   printf("Cyclist #%d | Track Position:  %.1fm | Place: %d | Speed: %d | Lap: %d\n", cyclist.number, cyclist.position + cyclist.half, cyclist.place, cyclist.speed, cyclist.lap);
+   int i, j, cyclist;
+
+   for(i = size - 1; i > 0; i--)
+   {
+      j = rng_below(&grid_rng, i + 1);
+      cyclist = cyclists[i];
+      cyclists[i] = cyclists[j];
+      cyclists[j] = cyclist;
+   }
 }
 
 /*Function to join the time thread*/
@@ -737,12 +2009,12 @@ void join_log_thread(pthread_t log_thread)
 }
 
 /*Function to create all Cyclists threads*/
-void create_threads(int cyclists, pthread_t *my_threads, Cyclist *thread_args)
+void create_threads(int cyclists, pthread_t *my_threads)
 {
    int i;
    for(i = 0; i < cyclists; i++)
    {
-      if (pthread_create(&my_threads[i], NULL, omnium, &thread_args[i])) 
+      if (pthread_create(&my_threads[i], NULL, omnium, (void*)(long)i)) 
       {
          printf("Error creating thread.");
          abort();
@@ -779,8 +2051,8 @@ int input_checker(int argc, char **argv)
 {
    int max_cyclists;
 
-   if(argc != EXPECTED_ARGS) {
-      printf("The format entrance entrance is d n [v|u].\n");
+   if(argc < EXPECTED_ARGS) {
+      printf("The format entrance entrance is d n [v|u] [--lockstep | --segments | --cruise] [--workers w] [--fast] [--seed s] [--batch races] [--jobs j] [--snapshot cycles] [--resume snapshot] [--trace] [--telemetry] [--track dense|sparse] [--debug-every cycles] [--debug-rows rows], or --serve [socket] [--jobs j].\n");
       exit(-1);
    }
 
@@ -789,6 +2061,11 @@ int input_checker(int argc, char **argv)
       exit(-1);
    }
 
+   if(atol(argv[1]) > MAXIMUM_METERS) {
+      printf("The track is expected to have at most %dm (found \"%sm\").\n", MAXIMUM_METERS, argv[1]);
+      exit(-1);
+   }
+
    if(atoi(argv[2]) <= MINIMUM_CYCLISTS) {
       printf("There must be at least 3 competitors (found \"%s\").\n", argv[2]);
       exit(-1);
@@ -802,39 +2079,2636 @@ int input_checker(int argc, char **argv)
 }
 
 /*Prints cyclists*/
-void print_cyclists(Cyclist *all_cyclists)
+void print_cyclists()
 {
-   int i = 0;
-   while(i < total_cyclists) print_cyclist(all_cyclists[i++]);
-   printf("\n");
+   char *text;
+   if(quiet) return;
+   text = malloc((total_cyclists + 2) * ROW_BYTES);
+   fwrite(text, 1, format_cyclists(text, peloton.position, peloton.place, peloton.velocity, peloton.lap), stdout);
+   fflush(stdout);
+   free(text);
 }
 
-/*Updates cyclists places if a cyclist broke*/
-void update_places(Cyclist *all_cyclists)
+/*Writes the lines of the cyclists (at most debug_rows of them) in text, followed by an empty line. Returns the length of the text*/
+int format_cyclists(char *text, int *position, int *place, int *speed, int *lap)
 {
-   int i = 0;
-   while(i < total_cyclists)
+   int i, rows = total_cyclists, length = 0;
+
+   if(debug_rows > 0 && debug_rows < rows) rows = debug_rows;
+   for(i = 0; i < rows; i++)
+      length += sprintf(text + length, "Cyclist #%d | Track Position:  %.1fm | Place: %d | Speed: %d | Lap: %d\n", peloton.number[i], (float)position[i] / POSITION_UNITS, place[i], KMH(speed[i]), lap[i]);
+   if(rows < total_cyclists) length += sprintf(text + length, "... and %d more cyclists\n", total_cyclists - rows);
+   length += sprintf(text + length, "\n");
+   return length;
+}
+
+/*Starts the renderer thread*/
+void start_renderer()
+{
+   renderer.position = malloc(total_cyclists * sizeof(int));
+   renderer.place = malloc(total_cyclists * sizeof(int));
+   renderer.speed = malloc(total_cyclists * sizeof(int));
+   renderer.lap = malloc(total_cyclists * sizeof(int));
+   renderer.text = malloc((total_cyclists + 2) * ROW_BYTES);
+   renderer.pending = renderer.closed = 0;
+   renderer.dropped = 0;
+   if(pthread_mutex_init(&renderer.lock, NULL) != 0 || pthread_cond_init(&renderer.wakeup, NULL) != 0)
+   {
+      printf("\nRenderer initialization failed.\n");
+      exit(1);
+   }
+   if (pthread_create(&renderer.thread, NULL, omnium_renderer, NULL)) 
    {
-      /*Updates cyclists positions in case someone has broken*/
-      if(try_to_break < all_cyclists[i].place && (all_cyclists[i].broken == 'N' && all_cyclists[i].eliminated == 'N')) (all_cyclists[i].place)--;
-      i++;
+      printf("Error creating renderer thread.");
+      abort();
    }
-   try_to_break = total_cyclists + 1;
-   update = 0;
 }
 
-void destroy_locks_and_semaphores()
+/*Writes the last frame, then stops the renderer thread*/
+void stop_renderer()
 {
-   int i = 0;
-   for(i = 0; i <= track_size; i++)
+   pthread_mutex_lock(&renderer.lock);
+      renderer.closed = 1;
+      pthread_cond_signal(&renderer.wakeup);
+   pthread_mutex_unlock(&renderer.lock);
+   if (pthread_join(renderer.thread, NULL)) 
+   {
+      printf("Error joining renderer thread.");
+      abort();
+   }
+   if(renderer.dropped > 0) printf("\n(%ld debug frames dropped: the output could not keep up)\n", renderer.dropped);
+   pthread_cond_destroy(&renderer.wakeup);
+   pthread_mutex_destroy(&renderer.lock);
+   free(renderer.position);
+   free(renderer.place);
+   free(renderer.speed);
+   free(renderer.lap);
+   free(renderer.text);
+}
+
+/*Hands a copy of the cyclists to the renderer. Never waits: if the renderer is busy, the frame is dropped*/
+void submit_frame()
+{
+   if(quiet) return;
+   if(pthread_mutex_trylock(&renderer.lock) != 0) 
+   {
+      renderer.dropped++;
+      return;
+   }
+   if(renderer.pending) renderer.dropped++;
+   else
+   {
+      memcpy(renderer.position, peloton.position, total_cyclists * sizeof(int));
+      memcpy(renderer.place, peloton.place, total_cyclists * sizeof(int));
+      memcpy(renderer.speed, peloton.velocity, total_cyclists * sizeof(int));
+      memcpy(renderer.lap, peloton.lap, total_cyclists * sizeof(int));
+      renderer.pending = 1;
+      pthread_cond_signal(&renderer.wakeup);
+   }
+   pthread_mutex_unlock(&renderer.lock);
+}
+
+/*Debug renderer. Formats the frames handed by the chronometer and writes each one with a single call*/
+void *omnium_renderer(void *args)
+{
+   int length;
+
+   pthread_mutex_lock(&renderer.lock);
+   while(1)
    {
-      pthread_mutex_destroy(&track[i].meter_lock);
-      sem_destroy(&track[i].mutex);
+      while(!renderer.pending && !renderer.closed) pthread_cond_wait(&renderer.wakeup, &renderer.lock);
+      if(!renderer.pending) break;
+      pthread_mutex_unlock(&renderer.lock);
+
+      length = format_cyclists(renderer.text, renderer.position, renderer.place, renderer.speed, renderer.lap);
+      fwrite(renderer.text, 1, length, stdout);
+      fflush(stdout);
+
+      pthread_mutex_lock(&renderer.lock);
+      renderer.pending = 0;
    }
+   pthread_mutex_unlock(&renderer.lock);
+   return NULL;
 }
 
-void update_timers(Cyclist *all_cyclists)
+void update_timers()
 {
    int i = 0;
-   for(i = 0; i < total_cyclists; i++) all_cyclists[i].cyclist_timer = clock() - start_timer;
-}
\ No newline at end of file
+   clock_t now = race_clock(), *cyclist_timer = peloton.cyclist_timer;
+   for(i = 0; i < total_cyclists; i++) cyclist_timer[i] = now;
+}
+
+/*Returns the race time duration, in clock ticks (CLOCKS_PER_SEC per second). It is the wall time since countdown() started the race, 
+or in headless mode the virtual clock, so broadcast() still reports simulated seconds*/
+clock_t race_clock()
+{
+   struct timespec now;
+
+   if(fast) return (clock_t)((double)ticks * CYCLE_NSEC / 1000000000.0 * CLOCKS_PER_SEC);
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (clock_t)(((double)(now.tv_sec - start_timer.tv_sec) + (now.tv_nsec - start_timer.tv_nsec) / 1000000000.0) * CLOCKS_PER_SEC) + clock_offset;
+}
+
+/*Sleeps x seconds, unless running headless*/
+void rest(int x)
+{
+   if(!fast) sleep(x);
+}
+/*Reads the optional arguments that follow d n [v|u]*/
+void get_options(int argc, char **argv)
+{
+   int i;
+
+   engine = THREAD_ENGINE;
+   workers = sysconf(_SC_NPROCESSORS_ONLN);
+   fast = 0;
+   seed = time(NULL);
+   grid = RANDOM_GRID;
+   heat_size = HEAT_SIZE;
+   batch = quiet = 0;
+   jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   logging = 1;
+   totals = NULL;
+   snapshot_every = 0;
+   resume_file = NULL;
+   tracing = streaming = 0;
+   sparse = 0;
+   debug_every = DEBUG_EVERY;
+   debug_rows = 0;
+
+   for(i = EXPECTED_ARGS; i < argc; i++)
+   {
+      if(strcmp(argv[i], "--lockstep") == 0) engine = LOCKSTEP_ENGINE;
+      else if(strcmp(argv[i], "--segments") == 0) engine = SEGMENT_ENGINE;
+      else if(strcmp(argv[i], "--cruise") == 0) engine = CRUISE_ENGINE;
+      else if(strcmp(argv[i], "--workers") == 0 && i + 1 < argc) 
+      {
+         if(engine == THREAD_ENGINE) engine = LOCKSTEP_ENGINE;
+         workers = atoi(argv[++i]);
+         if(workers < 1) {
+            printf("There must be at least 1 worker (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc) seed = strtoul(argv[++i], NULL, 10);
+      else if(strcmp(argv[i], "--grid") == 0 && i + 1 < argc) 
+      {
+         i++;
+         if(strcmp(argv[i], "random") == 0) grid = RANDOM_GRID;
+         else if(strcmp(argv[i], "ranked") == 0) grid = RANKED_GRID;
+         else if(strcmp(argv[i], "heats") == 0) grid = HEATS_GRID;
+         else {
+            printf("The starting grid must be random, ranked or heats (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--heat-size") == 0 && i + 1 < argc) 
+      {
+         grid = HEATS_GRID;
+         heat_size = atoi(argv[++i]);
+         if(heat_size < 1) {
+            printf("A heat must have at least 1 cyclist (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) 
+      {
+         batch = atoi(argv[++i]);
+         if(batch < 1) {
+            printf("A batch must have at least 1 race (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) 
+      {
+         snapshot_every = atol(argv[++i]);
+         if(snapshot_every < 1) {
+            printf("Snapshots must be at least 1 cycle apart (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--resume") == 0 && i + 1 < argc) resume_file = argv[++i];
+      else if(strcmp(argv[i], "--trace") == 0) tracing = 1;
+      else if(strcmp(argv[i], "--telemetry") == 0) streaming = 1;
+      else if(strcmp(argv[i], "--track") == 0 && i + 1 < argc) 
+      {
+         i++;
+         if(strcmp(argv[i], "dense") == 0) sparse = 0;
+         else if(strcmp(argv[i], "sparse") == 0) sparse = 1;
+         else {
+            printf("The track must be dense or sparse (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--debug-every") == 0 && i + 1 < argc) 
+      {
+         debug_every = atoi(argv[++i]);
+         if(debug_every < 1) {
+            printf("Debug frames must be at least 1 cycle apart (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--debug-rows") == 0 && i + 1 < argc) 
+      {
+         debug_rows = atoi(argv[++i]);
+         if(debug_rows < 0) {
+            printf("A debug frame can not have a negative number of rows (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) 
+      {
+         jobs = atoi(argv[++i]);
+         if(jobs < 1) {
+            printf("There must be at least 1 job (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      /*Headless mode needs a common clock for all the cyclists, so it always runs in ticks (lockstep, unless segments were asked for)*/
+      else if(strcmp(argv[i], "--fast") == 0) 
+      {
+         fast = 1;
+         if(engine == THREAD_ENGINE) engine = LOCKSTEP_ENGINE;
+      }
+      else {
+         printf("Unknown option \"%s\".\n", argv[i]);
+         exit(-1);
+      }
+   }
+   /*Snapshots and traces are taken, and the slots of a sparse track freed, between two cycles, which only the lockstep and segment engines have*/
+   if((snapshot_every > 0 || resume_file != NULL || tracing || sparse) && engine == THREAD_ENGINE) engine = LOCKSTEP_ENGINE;
+   /*A batch runs its races in parallel, each one headless, silent and in a single worker*/
+   if(batch > 0)
+   {
+      if(snapshot_every > 0 || resume_file != NULL || tracing || streaming) {
+         printf("A batch can not take snapshots, resume, be traced or stream telemetry.\n");
+         exit(-1);
+      }
+      fast = quiet = 1;
+      logging = 0;
+      if(engine != CRUISE_ENGINE) engine = LOCKSTEP_ENGINE;
+      workers = 1;
+      if(jobs > batch) jobs = batch;
+   }
+   /*The cruise engine skips cycles: traces, telemetry and debug frames, which show every cycle, need the lockstep engine*/
+   if(engine == CRUISE_ENGINE)
+   {
+      if(tracing || streaming || mode == 'U' || mode == 'V') engine = LOCKSTEP_ENGINE;
+      else workers = 1;
+   }
+   /*A worker without cyclists would only wait in the barrier*/
+   if(workers < 1) workers = 1;
+   if(workers > total_cyclists) workers = total_cyclists;
+   /*A segment has at least MAX_SPAN meters*/
+   if(engine == SEGMENT_ENGINE && workers > track_size / MAX_SPAN) workers = track_size / MAX_SPAN;
+}
+
+/*Function to create the lockstep workers. Each one owns a contiguous block of cyclists*/
+void create_workers(int workers, pthread_t *my_threads, Worker *pool)
+{
+   int i;
+   for(i = 0; i < workers; i++)
+   {
+      pool[i].id = i;
+      pool[i].first = (int)((long)total_cyclists * i / workers);
+      pool[i].last = (int)((long)total_cyclists * (i + 1) / workers);
+      if (pthread_create(&my_threads[i], NULL, omnium_lockstep, &pool[i])) 
+      {
+         printf("Error creating worker.");
+         abort();
+      }
+   }
+}
+
+/*Function to join all lockstep workers*/
+void join_workers(int workers, pthread_t *my_threads)
+{
+   join_threads(workers, my_threads);
+}
+
+/*Omnium race function for the lockstep engine. Each tick has two phases:
+1) every worker decides the new position of its own cyclists (decide_new_position()), in parallel;
+2) one worker moves all the cyclists, in a fixed order, through critical_section() and runs the chronometer.
+Both phases are closed by tick_barrier, so every worker sees the same race state when a tick begins*/
+void *omnium_lockstep(void *args)
+{
+   int cycles;
+   Worker *worker = ((Worker*) args);
+
+   wait_for_start();
+   cycles = ticks;
+
+   while(!RACE_OVER && !halted)
+   {
+      plan_moves(worker->first, worker->last);
+
+      if(BARRIER_WAIT(&tick_barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+      {
+         lockstep_moves();
+         lockstep_chronometer(cycles++);
+         tick_done();
+      }
+      BARRIER_WAIT(&tick_barrier);
+   }
+
+   return NULL;
+}
+
+/*Moves every cyclist to the position decided in this tick. 
+The cyclists that move are gathered once, and their conflicts are resolved per meter before anyone moves (see resolve_conflicts()): 
+a cyclist whose meter is clear goes straight into it, the others look for the farthest meter with room on the way.
+The tie-break is the index of the cyclists, in every meter: they move in that order, so the first ones take the room of a contested meter, 
+and the race is the one the segment and cruise engines run.
+Cyclists whose new meter is full are retried after the others moved, until nobody else can move. The ones left keep their intent and wait for the next tick.
+The retries only go through the cyclists still short of their intent (stopped in a nearer meter, or blocked)*/
+void lockstep_moves()
+{
+   int i, c, waiting, left, moved = 1;
+   long made = 0;
+
+   waiting = resolve_conflicts();
+   while(moved && !RACE_OVER)
+   {
+      moved = 0;
+      for(i = left = 0; i < waiting && !RACE_OVER; i++)
+      {
+         c = movers[i];
+         if(retired[c]) continue;
+         moved += lockstep_move(c, conflicts.nearest[c]);
+         if(retired[c] == 0 && intent[c] != peloton.position[c]) movers[left++] = c;
+      }
+      waiting = left;
+      made += moved;
+   }
+   moves += made;
+   COUNT_MOVES(made);
+   if(move_budget > 0 && moves >= move_budget) halted = 1;
+
+   /*The last cyclist competing won the race (or the race is over and all of them finished it)*/
+   if(RACE_OVER)
+      for(i = 0; i < total_cyclists; i++) if(retired[i] == 0) retire_cyclist(i);
+}
+
+/*Conflict pass of a tick of the lockstep engine. Gathers the cyclists that move in movers, and returns how many they are.
+The ones changing meter are bucketed by the meter they move into, and each meter is resolved once:
+it is clear when it has room for all of its arrivals, contested otherwise. A cyclist of a contested meter may stop in any meter on his way, 
+so those meters are contested too. 
+The cyclists of a clear meter get into it whatever the order, as nobody else does: they do not look for room on the way.
+The ones of a contested meter look for the farthest meter with room, and may stop short of their own one*/
+int resolve_conflicts()
+{
+   int k, c, from, span, waiting = 0, contested = 0;
+   Bucket *bucket, *other;
+
+   conflicts.pass++;
+   for(c = 0; c < total_cyclists; c++)
+   {
+      if(retired[c] || intent[c] == peloton.position[c]) continue;
+      movers[waiting++] = c;
+      from = METER(peloton.position[c]);
+      span = METER(intent[c]) - from;
+      if(span == 0) continue;
+      if(span < 0) span += track_size;
+      conflicts.nearest[c] = span;
+      bucket = find_bucket(METER(intent[c]), 1);
+      if(bucket->arrivals++ == 0) bucket->room = MAX_CYCLISTS - cyclists_in(bucket->meter);
+      conflicts.next[c] = bucket->first;
+      bucket->first = c;
+      if(bucket->arrivals == bucket->room + 1) 
+      {
+         bucket->contested = 1;
+         conflicts.contested[contested++] = bucket - conflicts.buckets;
+      }
+   }
+   /*A contested meter contests the meters on the way of its cyclists*/
+   while(contested > 0)
+   {
+      bucket = &conflicts.buckets[conflicts.contested[--contested]];
+      for(c = bucket->first; c != EMPTY; c = conflicts.next[c])
+      {
+         from = METER(peloton.position[c]);
+         for(k = 1; k < conflicts.nearest[c]; k++)
+         {
+            other = find_bucket((from + k) % track_size, 0);
+            if(other == NULL || other->contested) continue;
+            other->contested = 1;
+            conflicts.contested[contested++] = other - conflicts.buckets;
+         }
+         conflicts.nearest[c] = 1;
+      }
+   }
+   return waiting;
+}
+
+/*Returns the bucket of the meter in the current conflict pass. If it has none, a free bucket is claimed for it when claim is set, NULL is returned otherwise*/
+Bucket *find_bucket(int meter, int claim)
+{
+   unsigned int slot;
+   Bucket *bucket;
+
+   for(slot = (unsigned int)meter * METER_HASH & conflicts.mask; ; slot = (slot + 1) & conflicts.mask)
+   {
+      bucket = &conflicts.buckets[slot];
+      if(bucket->pass != conflicts.pass) break;
+      if(bucket->meter == meter) return bucket;
+   }
+   if(!claim) return NULL;
+   bucket->pass = conflicts.pass;
+   bucket->meter = meter;
+   bucket->arrivals = bucket->contested = 0;
+   bucket->first = EMPTY;
+   return bucket;
+}
+
+/*Moves one cyclist towards his intent, to the farthest meter with room on the way (at least nearest meters ahead). Returns 1 if he moved*/
+int lockstep_move(int cyclist, int nearest)
+{
+   int old_position = peloton.position[cyclist], new_position = intent[cyclist], field;
+
+   /*Ahead, in the same meter*/
+   if(METER(old_position) == METER(new_position)) 
+   {
+      peloton.position[cyclist] = new_position;
+      return 1;
+   }
+
+   field = reserve_on_the_way(old_position, &new_position, nearest);
+   if(field == EMPTY) return 0;
+   critical_section(cyclist, old_position, new_position, field);
+   if(disqualified(cyclist) == 1) 
+   {
+      release_field(METER(new_position), field);
+      retire_cyclist(cyclist);
+   }
+   return 1;
+}
+
+/*Takes the cyclist out of the lockstep engine and announces it. Like a cyclist thread that leaves omnium()*/
+void retire_cyclist(int cyclist)
+{
+   retired[cyclist] = 1;
+   broadcast(cyclist);
+   release_elimination(cyclist);
+}
+
+/*Chronometer duties of the lockstep engine, run once at the end of every tick*/
+void lockstep_chronometer(int cycles)
+{
+   /*Simulation timer, counted in cycles of 0.72ms. In headless mode the virtual clock just moves on*/
+   if(!fast) await(CYCLE_NSEC);
+   ticks++;
+#ifdef INSTRUMENT
+   check_dump_request();
+#endif
+   update_timers();
+   if(streaming) sample_telemetry();
+   /*DEBUG MODE*/
+   if((mode == 'U' || mode == 'V') && cycles % debug_every == 0) submit_frame();
+}
+
+/*Function to create the segment workers. The track is split in workers segments of (nearly) the same size, and every cyclist starts in the segment of his meter*/
+void create_segments(int workers, pthread_t *my_threads)
+{
+   int i, k;
+   Segment *segment;
+
+   segments = arena_alloc(workers * sizeof(Segment));
+   segments_running = !RACE_OVER && !halted;
+   for(k = 0; k < workers; k++)
+   {
+      segment = &segments[k];
+      segment->first = (int)((long)track_size * k / workers);
+      segment->last = (int)((long)track_size * (k + 1) / workers);
+      segment->roster = arena_alloc(total_cyclists * sizeof(int));
+      segment->riders = segment->arrivals = 0;
+      segment->moves = 0;
+      for(i = 0; i < total_cyclists; i++)
+         if(in_segment(segment, peloton.position[i])) segment->roster[segment->riders++] = i;
+   }
+   for(k = 0; k < workers; k++)
+      if (pthread_create(&my_threads[k], NULL, omnium_segments, (void*)(long)k)) 
+      {
+         printf("Error creating worker.");
+         abort();
+      }
+}
+
+/*Returns 1 if the position (in units) is in the segment*/
+int in_segment(Segment *segment, int position)
+{
+   return METER(position) >= segment->first && METER(position) < segment->last;
+}
+
+/*Omnium race function for the segment engine. Each tick has three phases:
+1) every worker plans and makes the moves that stay in its segment, and hands the cyclists leaving it to the next segment (segment_sweep());
+2) every worker moves the cyclists it received (segment_arrivals());
+3) one worker runs the chronometer (segment_tick()).
+Each phase is closed by tick_barrier. With one worker the race is the same for the same seed; with more, cyclists in different segments cross the line and overtake in any order, like in the thread engine*/
+void *omnium_segments(void *args)
+{
+   int k = (int)(long) args, cycles;
+
+   wait_for_start();
+   cycles = ticks;
+
+   while(segments_running)
+   {
+      segment_sweep(k);
+      BARRIER_WAIT(&tick_barrier);
+      segment_arrivals(k);
+      if(BARRIER_WAIT(&tick_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) segment_tick(cycles++);
+      BARRIER_WAIT(&tick_barrier);
+   }
+
+   return NULL;
+}
+
+/*First phase of a tick of the segment engine*/
+void segment_sweep(int k)
+{
+   Segment *segment = &segments[k], *next = &segments[(k + 1) % workers];
+   int i, c, riders = 0, moved = 1;
+
+   /*Forgets the cyclists that left the race or moved to the next segment, and plans the moves of the others*/
+   for(i = 0; i < segment->riders; i++)
+   {
+      c = segment->roster[i];
+      if(retired[c] || !in_segment(segment, peloton.position[c])) continue;
+      segment->roster[riders++] = c;
+      plan_moves(c, c + 1);
+   }
+   segment->riders = riders;
+
+   /*Moves inside the segment, like lockstep_moves()*/
+   while(moved && !RACE_OVER)
+   {
+      moved = 0;
+      for(i = 0; i < segment->riders && !RACE_OVER; i++)
+      {
+         c = segment->roster[i];
+         if(!retired[c] && intent[c] != peloton.position[c] && in_segment(segment, intent[c])) moved += lockstep_move(c, 1);
+      }
+      segment->moves += moved;
+   }
+
+   /*The others are leaving the segment*/
+   for(i = 0; i < segment->riders; i++)
+   {
+      c = segment->roster[i];
+      if(retired[c] || intent[c] == peloton.position[c] || in_segment(segment, intent[c])) continue;
+      if(next->arrivals == MAX_CYCLISTS * MAX_SPAN)
+      {
+         printf("\nError. Inbox of the segment [%d...%d] is full.\n", next->first, next->last - 1);
+         exit(1);
+      }
+      next->inbox[next->arrivals++] = c;
+   }
+}
+
+/*Second phase of a tick of the segment engine. Cyclists that found their new meter full stay in the previous segment and try again in the next tick*/
+void segment_arrivals(int k)
+{
+   Segment *segment = &segments[k];
+   int i, c;
+
+   for(i = 0; i < segment->arrivals; i++)
+   {
+      c = segment->inbox[i];
+      /*He stays in this segment, even if he can not reach his new meter*/
+      if(RACE_OVER || !lockstep_move(c, (segment->first - METER(peloton.position[c]) + track_size) % track_size)) continue;
+      segment->moves++;
+      if(!retired[c]) segment->roster[segment->riders++] = c;
+   }
+   segment->arrivals = 0;
+}
+
+/*Third phase of a tick of the segment engine, run by a single worker*/
+void segment_tick(int cycles)
+{
+   int i;
+   long made = 0;
+
+   for(i = 0; i < workers; i++)
+   {
+      made += segments[i].moves;
+      segments[i].moves = 0;
+   }
+   moves += made;
+   COUNT_MOVES(made);
+   /*The last cyclist competing won the race (or the race is over and all of them finished it)*/
+   if(RACE_OVER)
+      for(i = 0; i < total_cyclists; i++) if(retired[i] == 0) retire_cyclist(i);
+   if(move_budget > 0 && moves >= move_budget) halted = 1;
+   segments_running = !RACE_OVER && !halted;
+   lockstep_chronometer(cycles);
+   tick_done();
+}
+
+/*Allocates the state of the cruise engine*/
+void make_cruise(int cyclists)
+{
+   cruise.position = arena_alloc(cyclists * sizeof(int));
+   cruise.velocity = arena_alloc(cyclists * sizeof(int));
+   cruise.draft = arena_alloc(cyclists * sizeof(int));
+   cruise.lap = arena_alloc(cyclists * sizeof(int));
+   cruise.place = arena_alloc(cyclists * sizeof(int));
+   cruise.field = arena_alloc(cyclists * sizeof(int));
+   cruise.shift = arena_alloc(cyclists * sizeof(int));
+   cruise.order = arena_alloc(cyclists * sizeof(int));
+   cruise.status = arena_alloc(cyclists * sizeof(unsigned char));
+   cruise.retired = arena_alloc(cyclists * sizeof(char));
+   cruise.log = arena_alloc(CRUISE_EVENTS * sizeof(RaceEvent));
+   cruise.riders = cruise.logged = 0;
+   cruise.stretch = 1;
+}
+
+/*Omnium race function for the cruise engine, run by a single worker. The cycles run like in the lockstep engine, in windows of a period:
+when the race cruised through a window, it jumps over the periods it goes on cruising (see cruise_length())*/
+void *omnium_cruise(void *args)
+{
+   int cycles;
+   long periods;
+
+   wait_for_start();
+   cycles = ticks;
+   open_window();
+
+   while(!RACE_OVER && !halted)
+   {
+      plan_moves(0, total_cyclists);
+      lockstep_moves();
+      lockstep_chronometer(cycles++);
+      tick_done();
+      if(RACE_OVER || halted || ticks - cruise.tick < cruise.period) continue;
+      if(!cruising()) cruise.stretch = MIN(2 * cruise.stretch, CRUISE_STRETCH);
+      else 
+      {
+         cruise.stretch = 1;
+         if((periods = cruise_length()) > 0) leap(periods);
+      }
+      open_window();
+   }
+   return NULL;
+}
+
+/*Starts a window: keeps the state of every cyclist, and the period of the window. 
+A velocity of v units per cycle covers a whole number of meters in POSITION_UNITS/(v & -v) cycles (POSITION_UNITS is a power of 2): 
+the period of the velocities is the longest one of the cyclists still in the race, and the window lasts stretch of them*/
+void open_window()
+{
+   int c, low;
+
+   cruise.tick = ticks;
+   cruise.moves = moves;
+   cruise.logged = 0;
+   cruise.period = 1;
+   for(c = 0; c < total_cyclists; c++)
+   {
+      cruise.status[c] = peloton.status[c];
+      cruise.retired[c] = retired[c];
+      if(retired[c]) continue;
+      cruise.position[c] = peloton.position[c];
+      cruise.velocity[c] = peloton.velocity[c];
+      cruise.draft[c] = peloton.draft[c];
+      cruise.lap[c] = peloton.lap[c];
+      cruise.place[c] = peloton.place[c];
+      cruise.field[c] = field_of(c);
+      low = peloton.velocity[c] & -peloton.velocity[c];
+      if(low > 0 && low < POSITION_UNITS && POSITION_UNITS / low > cruise.period) cruise.period = POSITION_UNITS / low;
+   }
+   cruise.period *= cruise.stretch;
+}
+
+/*Returns 1 if the race cruised through the window: nobody left the race and every cyclist is in the state he started it in 
+(lap, velocity, draft, place and field of his meter), but for a whole number of meters ahead: his shift. The overtakes of the window, 
+given back in it, are the only events it can have. The cyclists in the race are gathered in order*/
+int cruising()
+{
+   int c, units;
+
+   if(cruise.logged > CRUISE_EVENTS) return 0;
+   for(c = 0; c < total_cyclists; c++) if(peloton.status[c] != cruise.status[c] || retired[c] != cruise.retired[c]) return 0;
+   cruise.riders = 0;
+   for(c = 0; c < total_cyclists; c++)
+   {
+      cruise.shift[c] = 0;
+      if(retired[c]) continue;
+      units = peloton.position[c] - cruise.position[c];
+      if(units % POSITION_UNITS != 0 || peloton.lap[c] != cruise.lap[c] || peloton.velocity[c] != cruise.velocity[c] 
+         || peloton.draft[c] != cruise.draft[c] || peloton.place[c] != cruise.place[c] || field_of(c) != cruise.field[c]) return 0;
+      cruise.shift[c] = units / POSITION_UNITS;
+      cruise.order[cruise.riders++] = c;
+   }
+   return 1;
+}
+
+/*Returns the periods the race can jump in cruise: the ones before it leaves the cruise, which is then run cycle by cycle. It leaves it when 
+a cyclist crosses the line (his lap changes, and with it his speed, the breaks, the eliminations and the sprints) or covers the race, 
+two cyclists with different shifts come in reach of each other on the track or in the standings, a snapshot is due or the move budget is spent.
+The cyclists with the same shift keep their places among themselves: only the neighbours with different shifts are checked*/
+long cruise_length()
+{
+   int i, a, b, lap_length = POSITION_UNITS * track_size, uniform = 1;
+   long periods = track_size, made = moves - cruise.moves, gap, reach;
+
+   for(i = 0; i < cruise.riders; i++)
+   {
+      a = cruise.order[i];
+      if(cruise.shift[a] != cruise.shift[cruise.order[0]]) uniform = 0;
+      if(cruise.shift[a] == 0) continue;
+      periods = MIN(periods, (lap_length - 1 - peloton.position[a]) / ((long)cruise.shift[a] * POSITION_UNITS));
+#if FINISH_LAPS
+      periods = MIN(periods, ((long)FINISH_LAPS * track_size - 1 - standings.distance[a]) / cruise.shift[a]);
+#endif
+   }
+   /*The snapshot is taken at the end of the cycle next_snapshot-1 (see tick_done())*/
+   if(snapshot_every > 0) periods = MIN(periods, (next_snapshot - 1 - ticks) / cruise.period);
+   if(move_budget > 0 && made > 0) periods = MIN(periods, (move_budget - 1 - moves) / made);
+   if(uniform || periods <= 0) return periods;
+
+   /*A cyclist sees the meters up to his shift (plus the meter ahead, for the draft) in a period. The gaps are in meters, 
+   checked at the start of the window (before its shifts) and at the end of the last period*/
+   qsort(cruise.order, cruise.riders, sizeof(int), by_position);
+   for(i = 0; i < cruise.riders && cruise.riders > 1; i++)
+   {
+      a = cruise.order[i];
+      b = cruise.order[(i + 1) % cruise.riders];
+      if(cruise.shift[a] == cruise.shift[b]) continue;
+      gap = METER(peloton.position[b]) - METER(peloton.position[a]) + (i + 1 == cruise.riders ? track_size : 0);
+      reach = cruise.shift[a] + MAX_SPAN;
+      if(gap <= reach || gap - (cruise.shift[b] - cruise.shift[a]) <= reach) return 0;
+      if(cruise.shift[a] > cruise.shift[b]) periods = MIN(periods, (gap - reach - 1) / (cruise.shift[a] - cruise.shift[b]));
+   }
+   /*The cyclist behind passes the one ahead in the standings once his distance is greater*/
+   for(i = 1; i < standings.competing; i++)
+   {
+      a = standings.rank[i - 1];
+      b = standings.rank[i];
+      if(cruise.shift[a] == cruise.shift[b]) continue;
+      gap = standings.distance[a] - standings.distance[b] - cruise.shift[b];
+      if(gap < 0 || gap - (cruise.shift[a] - cruise.shift[b]) < 0) return 0;
+      if(cruise.shift[b] > cruise.shift[a]) periods = MIN(periods, gap / (cruise.shift[b] - cruise.shift[a]));
+   }
+   return periods;
+}
+
+/*Jumps periods periods of the cruise: every cyclist is written shift meters ahead per period, in the field he has, 
+the events of the window are published again in every period, and the cycles and the moves of the periods are counted. 
+Everybody is taken out of the track first, as the cyclists of a group move into each other's meters*/
+void leap(long periods)
+{
+   int i, c, meter, lap_length = POSITION_UNITS * track_size;
+   long units, cycles, k;
+   Meter *cell;
+   RaceEvent event;
+
+   for(i = 0; i < cruise.riders; i++)
+   {
+      c = cruise.order[i];
+      if(cruise.shift[c] > 0) erase_cyclist(c, peloton.position[c]);
+   }
+   for(i = 0; i < cruise.riders; i++)
+   {
+      c = cruise.order[i];
+      if(cruise.shift[c] == 0) continue;
+      units = periods * cruise.shift[c] * POSITION_UNITS;
+      peloton.position[c] += units;
+      intent[c] = (intent[c] + units) % lap_length;
+      standings.distance[c] += periods * cruise.shift[c];
+      meter = METER(peloton.position[c]);
+      cell = claim_meter(meter);
+      if(cell->occupancy & (1u << cruise.field[c]))
+      {
+         printf("\nError. Field %d of track[%d] taken by the cruise of cyclist #%d.\n", cruise.field[c], meter, peloton.number[c]);
+         exit(1);
+      }
+      cell->occupancy |= 1u << cruise.field[c];
+      cell->cyclist[cruise.field[c]] = c + 1;
+   }
+   for(k = 1; k <= periods; k++)
+   {
+      for(i = 0; i < cruise.logged; i++)
+      {
+         event = cruise.log[i];
+         event.tick += k * cruise.period;
+         publish_event(&event);
+      }
+      if(!fast) for(cycles = 0; cycles < cruise.period; cycles++) await(CYCLE_NSEC);
+   }
+   moves += periods * (moves - cruise.moves);
+   ticks += periods * cruise.period;
+   update_timers();
+   if(sparse) free_vacated_meters();
+}
+
+/*Returns the field of the cyclist in his meter*/
+int field_of(int cyclist)
+{
+   Meter *cell = find_meter(METER(peloton.position[cyclist]));
+   int field;
+
+   for(field = 0; field < MAX_CYCLISTS && cell->cyclist[field] != cyclist + 1; field++) continue;
+   return field;
+}
+
+/*Orders cyclists by their position on the track, then by their index (qsort)*/
+int by_position(const void *a, const void *b)
+{
+   int x = *(const int*)a, y = *(const int*)b;
+   if(peloton.position[x] != peloton.position[y]) return peloton.position[x] < peloton.position[y] ? -1 : 1;
+   return x - y;
+}
+
+/*Allocates the event ring*/
+void make_event_ring()
+{
+   unsigned long i;
+   events.cells = arena_alloc(EVENT_RING_SIZE * sizeof(EventCell));
+   for(i = 0; i < EVENT_RING_SIZE; i++) events.cells[i].sequence = i;
+   events.head = events.tail = 0;
+   events.closed = events.sleeping = events.full = 0;
+   if(pthread_mutex_init(&events.lock, NULL) != 0 || pthread_cond_init(&events.wakeup, NULL) != 0 || pthread_cond_init(&events.room, NULL) != 0)
+   {
+      printf("\nEvent ring signal initialization failed.\n");
+      exit(1);
+   }
+}
+
+/*Destroys the signal of the event ring. The cells are freed with the arena*/
+void destroy_event_ring()
+{
+   pthread_cond_destroy(&events.wakeup);
+   pthread_cond_destroy(&events.room);
+   pthread_mutex_destroy(&events.lock);
+}
+
+/*Publishes an event. Waits if the ring is full*/
+void publish_event(RaceEvent *event)
+{
+   unsigned long position = __atomic_load_n(&events.head, __ATOMIC_RELAXED), sequence;
+   EventCell *cell;
+
+   while(1)
+   {
+      cell = &events.cells[position & (EVENT_RING_SIZE - 1)];
+      sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+      if(sequence == position)
+      {
+         /*The cell is free: try to take this position. On failure position is reloaded with the current head*/
+         if(__atomic_compare_exchange_n(&events.head, &position, position + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+      }
+      else if((long)(sequence - position) < 0)
+      {
+         /*Full: the logger did not consume the event of the last lap around the ring yet*/
+         PROBE_BEGIN(PROBE_RING_FULL);
+         wait_for_room(cell, position);
+         PROBE_END(PROBE_RING_FULL);
+         position = __atomic_load_n(&events.head, __ATOMIC_RELAXED);
+      }
+      else position = __atomic_load_n(&events.head, __ATOMIC_RELAXED);
+   }
+
+   cell->event = *event;
+   __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+   /*Wakes the logger if it is sleeping. The fence pairs with the one in wait_for_events(): either it sees sleeping, or the logger sees the event*/
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&events.sleeping, __ATOMIC_RELAXED))
+   {
+      pthread_mutex_lock(&events.lock);
+         pthread_cond_signal(&events.wakeup);
+      pthread_mutex_unlock(&events.lock);
+   }
+}
+
+/*Puts a producer to sleep until the logger frees the cell of the position. The fence pairs with the one in wake_producers(): 
+either the producer sees the cell freed, or the logger sees him waiting*/
+void wait_for_room(EventCell *cell, unsigned long position)
+{
+   pthread_mutex_lock(&events.lock);
+      __atomic_add_fetch(&events.full, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      while((long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position) < 0) pthread_cond_wait(&events.room, &events.lock);
+      __atomic_sub_fetch(&events.full, 1, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&events.lock);
+}
+
+/*Wakes the producers waiting for room, once the logger consumed a batch. Only the logger calls it*/
+void wake_producers()
+{
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&events.full, __ATOMIC_RELAXED))
+   {
+      pthread_mutex_lock(&events.lock);
+         pthread_cond_broadcast(&events.room);
+      pthread_mutex_unlock(&events.lock);
+   }
+}
+
+/*Returns 1 if the next event was published and can be consumed. Only the logger calls it*/
+int event_ready()
+{
+   EventCell *cell = &events.cells[events.tail & (EVENT_RING_SIZE - 1)];
+   return __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) == events.tail + 1;
+}
+
+/*Puts the logger to sleep until an event is published or the ring is closed*/
+void wait_for_events()
+{
+   pthread_mutex_lock(&events.lock);
+      __atomic_store_n(&events.sleeping, 1, __ATOMIC_RELAXED);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      PROBE_BEGIN(PROBE_LOGGER_SLEEP);
+      while(!event_ready() && !__atomic_load_n(&events.closed, __ATOMIC_ACQUIRE)) pthread_cond_wait(&events.wakeup, &events.lock);
+      PROBE_END(PROBE_LOGGER_SLEEP);
+      __atomic_store_n(&events.sleeping, 0, __ATOMIC_RELAXED);
+   pthread_mutex_unlock(&events.lock);
+}
+
+/*Consumes the next event, if there is one. Returns 1 if it did. Only the logger calls it*/
+int consume_event(RaceEvent *event)
+{
+   EventCell *cell = &events.cells[events.tail & (EVENT_RING_SIZE - 1)];
+
+   if(!event_ready()) return 0;
+   *event = cell->event;
+   /*Frees the cell for the next lap around the ring*/
+   __atomic_store_n(&cell->sequence, events.tail + EVENT_RING_SIZE, __ATOMIC_RELEASE);
+   events.tail++;
+   return 1;
+}
+
+/*Tells the logger no more events will be published*/
+void close_event_ring()
+{
+   pthread_mutex_lock(&events.lock);
+      __atomic_store_n(&events.closed, 1, __ATOMIC_RELEASE);
+      pthread_cond_signal(&events.wakeup);
+   pthread_mutex_unlock(&events.lock);
+}
+
+/*Publishes an event about the cyclist. other is a second cyclist (or EMPTY), or the slot of an EVENT_LOSER*/
+void log_event(int type, int cyclist, int other)
+{
+   RaceEvent event;
+
+   if(!logging) return;
+   memset(&event, 0, sizeof(event));
+   event.type = type;
+   event.tick = ticks;
+   event.cyclist = peloton.number[cyclist];
+   event.lap = peloton.lap[cyclist];
+   event.place = peloton.place[cyclist];
+   event.competing = cyclists_competing();
+   if(type == EVENT_LOSER) event.slot = other;
+   else if(other != EMPTY) event.other = peloton.number[other];
+   publish_event(&event);
+   /*The cruise engine keeps the events of its window, to repeat them*/
+   if(engine == CRUISE_ENGINE && cruise.logged++ < CRUISE_EVENTS) cruise.log[cruise.logged - 1] = event;
+}
+
+/*Publishes the winners of the race: the cyclists in the 1st, 2nd and 3rd places*/
+void log_winners()
+{
+   int i, order[3] = {0, 0, 0};
+   RaceEvent event;
+
+   for(i = 0; i < total_cyclists; i++)
+   {
+      if(peloton.place[i] == 1) order[0] = i;
+      if(peloton.place[i] == 2) order[1] = i;
+      if(peloton.place[i] == 3) order[2] = i;
+   }
+
+   memset(&event, 0, sizeof(event));
+   event.type = EVENT_WINNERS;
+   event.tick = ticks;
+   event.cyclist = peloton.number[order[0]];
+   event.other = peloton.number[order[1]];
+   event.third = peloton.number[order[2]];
+   event.competing = cyclists_competing();
+   publish_event(&event);
+}
+
+/*Runs a batch of races with the seeds seed, seed+1... seed+batch-1. 
+The races are split among jobs processes. Each one runs its races one after the other and sends its statistics back through a pipe*/
+void run_batch()
+{
+   int j, k, (*pipes)[2], status;
+   unsigned long first_seed = seed;
+   pid_t *children;
+   BatchTotals all, part;
+
+   pipes = malloc(jobs * sizeof(*pipes));
+   children = malloc(jobs * sizeof(pid_t));
+   make_totals(&all, total_cyclists);
+   /*Nothing buffered may be printed twice*/
+   fflush(stdout);
+
+   for(j = 0; j < jobs; j++)
+   {
+      if(pipe(pipes[j]) != 0)
+      {
+         printf("\nError creating pipe.\n");
+         exit(1);
+      }
+      children[j] = fork();
+      if(children[j] < 0)
+      {
+         printf("\nError creating job.\n");
+         exit(1);
+      }
+      if(children[j] == 0)
+      {
+         close(pipes[j][0]);
+         make_totals(&part, total_cyclists);
+         totals = &part;
+         for(k = j; k < batch; k += jobs)
+         {
+            seed = first_seed + k;
+            run_race();
+         }
+         send_totals(pipes[j][1], &part, total_cyclists);
+         _exit(0);
+      }
+      close(pipes[j][1]);
+   }
+
+   for(j = 0; j < jobs; j++)
+   {
+      make_totals(&part, total_cyclists);
+      receive_totals(pipes[j][0], &part, total_cyclists);
+      add_totals(&all, &part, total_cyclists);
+      destroy_totals(&part);
+      close(pipes[j][0]);
+      waitpid(children[j], &status, 0);
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+         printf("\nJob %d failed.\n", j);
+         exit(1);
+      }
+   }
+
+   print_summary(&all, first_seed);
+   destroy_totals(&all);
+   free(pipes);
+   free(children);
+}
+
+/*Allocates empty batch statistics for a race of "cyclists" cyclists*/
+void make_totals(BatchTotals *t, int cyclists)
+{
+   t->races = t->ticks = 0;
+   t->wins = calloc(cyclists, sizeof(long));
+   t->podiums = calloc(cyclists, sizeof(long));
+   t->breaks = calloc(cyclists, sizeof(long));
+   t->places = calloc(cyclists, sizeof(long));
+}
+
+/*Frees batch statistics*/
+void destroy_totals(BatchTotals *t)
+{
+   free(t->wins);
+   free(t->podiums);
+   free(t->breaks);
+   free(t->places);
+}
+
+/*Adds the result of the race that just ended to the statistics. The cyclist i started in the place total_cyclists-i*/
+void tally_race(BatchTotals *t)
+{
+   int i, start;
+   t->races++;
+   t->ticks += ticks;
+   for(i = 0; i < total_cyclists; i++)
+   {
+      start = total_cyclists - i - 1;
+      t->wins[start] += peloton.place[i] == 1;
+      t->podiums[start] += peloton.place[i] <= 3;
+      t->breaks[start] += (peloton.status[i] & BROKEN) != 0;
+      t->places[start] += peloton.place[i];
+   }
+}
+
+/*Adds the statistics "part" to "all"*/
+void add_totals(BatchTotals *all, BatchTotals *part, int cyclists)
+{
+   int i;
+   all->races += part->races;
+   all->ticks += part->ticks;
+   for(i = 0; i < cyclists; i++)
+   {
+      all->wins[i] += part->wins[i];
+      all->podiums[i] += part->podiums[i];
+      all->breaks[i] += part->breaks[i];
+      all->places[i] += part->places[i];
+   }
+}
+
+/*Writes n bytes in the file descriptor fd*/
+void write_all(int fd, void *buffer, size_t n)
+{
+   char *p = buffer;
+   ssize_t written;
+   while(n > 0)
+   {
+      written = write(fd, p, n);
+      if(written <= 0)
+      {
+         printf("\nError writing batch statistics.\n");
+         _exit(1);
+      }
+      p += written;
+      n -= written;
+   }
+}
+
+/*Reads n bytes from the file descriptor fd*/
+void read_all(int fd, void *buffer, size_t n)
+{
+   char *p = buffer;
+   ssize_t got;
+   while(n > 0)
+   {
+      got = read(fd, p, n);
+      if(got <= 0)
+      {
+         printf("\nError reading batch statistics.\n");
+         exit(1);
+      }
+      p += got;
+      n -= got;
+   }
+}
+
+/*Sends the statistics of a job through a pipe*/
+void send_totals(int fd, BatchTotals *t, int cyclists)
+{
+   write_all(fd, &t->races, sizeof(long));
+   write_all(fd, &t->ticks, sizeof(long));
+   write_all(fd, t->wins, cyclists * sizeof(long));
+   write_all(fd, t->podiums, cyclists * sizeof(long));
+   write_all(fd, t->breaks, cyclists * sizeof(long));
+   write_all(fd, t->places, cyclists * sizeof(long));
+}
+
+/*Receives the statistics of a job*/
+void receive_totals(int fd, BatchTotals *t, int cyclists)
+{
+   read_all(fd, &t->races, sizeof(long));
+   read_all(fd, &t->ticks, sizeof(long));
+   read_all(fd, t->wins, cyclists * sizeof(long));
+   read_all(fd, t->podiums, cyclists * sizeof(long));
+   read_all(fd, t->breaks, cyclists * sizeof(long));
+   read_all(fd, t->places, cyclists * sizeof(long));
+}
+
+/*Prints the statistics of the batch, by starting place*/
+void print_summary(BatchTotals *t, unsigned long first_seed)
+{
+   int i;
+   double races = t->races;
+
+   printf("OMNIUM BATCH (Mode = %c): %ld races, %dm track, %d cyclists, seeds %lu...%lu\n", mode, t->races, track_size, total_cyclists, first_seed, first_seed + t->races - 1);
+   printf("Mean race time: %.1fs\n\n", (double)t->ticks * CYCLE_NSEC / 1000000000.0 / races);
+   printf("Start | Wins | Win %% | Podiums | Podium %% | Breaks | Break %% | Mean place\n");
+   for(i = 0; i < total_cyclists; i++)
+      printf("%5d | %4ld | %5.1f | %7ld | %8.1f | %6ld | %7.1f | %10.2f\n", i + 1, t->wins[i], 100.0 * t->wins[i] / races, t->podiums[i], 100.0 * t->podiums[i] / races, t->breaks[i], 100.0 * t->breaks[i] / races, t->places[i] / races);
+}
+
+/*Server mode: ./race --serve [socket] [--jobs j]. Reads races from the standard input, or from the clients of a Unix domain socket, one per line:
+d n u|v [--seed s] [--grid random|ranked|heats] [--heat-size h]. The races are queued and run by a pool of j jobs (one per core by default): 
+processes started once, that run races one after another, headless, in an arena they keep. Each result is written back to the client 
+that asked for the race as soon as it is known (see collect_result()), so results come in the order the races end.
+Reading the standard input, the server ends once every race was answered; on a socket it runs until it is killed*/
+void serve(int argc, char **argv)
+{
+   struct sockaddr_un address;
+   struct pollfd *polled;
+   const char *path = NULL;
+   int i, j, c, n, *owner, listener = -1;
+
+   jobs = sysconf(_SC_NPROCESSORS_ONLN);
+   for(i = 2; i < argc; i++)
+   {
+      if(strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) 
+      {
+         jobs = atoi(argv[++i]);
+         if(jobs < 1) {
+            printf("There must be at least 1 job (found \"%s\").\n", argv[i]);
+            exit(-1);
+         }
+      }
+      else if(path == NULL && argv[i][0] != '-') path = argv[i];
+      else {
+         printf("The format entrance is --serve [socket] [--jobs j].\n");
+         exit(-1);
+      }
+   }
+   if(path != NULL && strlen(path) >= sizeof(address.sun_path)) {
+      printf("The socket path \"%s\" is too long.\n", path);
+      exit(-1);
+   }
+
+   /*The jobs are started first, so they inherit no client*/
+   fflush(stdout);
+   start_jobs();
+   for(c = 0; c < SERVER_CLIENTS; c++) clients[c].in = clients[c].out = -1;
+   if(path == NULL)
+   {
+      clients[0].in = STDIN_FILENO;
+      clients[0].out = STDOUT_FILENO;
+   }
+   else
+   {
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strcpy(address.sun_path, path);
+      unlink(path);
+      listener = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SERVER_CLIENTS) != 0)
+      {
+         printf("\nCould not open %s.\n", path);
+         exit(1);
+      }
+   }
+   /*A client that leaves while its results are written must not kill the server*/
+   signal(SIGPIPE, SIG_IGN);
+
+   polled = malloc((1 + SERVER_CLIENTS + jobs) * sizeof(struct pollfd));
+   owner = malloc((1 + SERVER_CLIENTS + jobs) * sizeof(int));
+   while(1)
+   {
+      dispatch();
+      /*Waits for the listener (owner -1), the clients (owner c) and the busy jobs (owner SERVER_CLIENTS + j)*/
+      n = 0;
+      if(listener >= 0) 
+      {
+         polled[n].fd = listener;
+         owner[n++] = -1;
+      }
+      for(c = 0; c < SERVER_CLIENTS; c++)
+         if(clients[c].in >= 0) 
+         {
+            polled[n].fd = clients[c].in;
+            owner[n++] = c;
+         }
+      for(j = 0; j < jobs; j++)
+         if(job_pool[j].busy) 
+         {
+            polled[n].fd = job_pool[j].results;
+            owner[n++] = SERVER_CLIENTS + j;
+         }
+      /*The standard input is over and every race was answered*/
+      if(n == 0) break;
+      for(i = 0; i < n; i++) polled[i].events = POLLIN;
+      if(poll(polled, n, -1) < 0)
+      {
+         if(errno == EINTR) continue;
+         printf("\nError waiting for the clients.\n");
+         exit(1);
+      }
+      for(i = 0; i < n; i++)
+      {
+         if(polled[i].revents == 0) continue;
+         if(owner[i] < 0) accept_client(listener);
+         else if(owner[i] < SERVER_CLIENTS) read_client(owner[i]);
+         else collect_result(&job_pool[owner[i] - SERVER_CLIENTS]);
+      }
+   }
+
+   stop_jobs();
+   free(polled);
+   free(owner);
+   free(queue.specs);
+}
+
+/*Starts the jobs of the server. A job gets its races through a pipe and sends their results through another*/
+void start_jobs()
+{
+   int j, k, requests[2], results[2];
+
+   job_pool = malloc(jobs * sizeof(Job));
+   for(j = 0; j < jobs; j++)
+   {
+      if(pipe(requests) != 0 || pipe(results) != 0)
+      {
+         printf("\nError creating pipe.\n");
+         exit(1);
+      }
+      job_pool[j].pid = fork();
+      if(job_pool[j].pid < 0)
+      {
+         printf("\nError creating job.\n");
+         exit(1);
+      }
+      if(job_pool[j].pid == 0)
+      {
+         close(requests[1]);
+         close(results[0]);
+         /*The pipes of the jobs started before belong to the server*/
+         for(k = 0; k < j; k++)
+         {
+            close(job_pool[k].requests);
+            close(job_pool[k].results);
+         }
+         run_job(requests[0], results[1]);
+      }
+      close(requests[0]);
+      close(results[1]);
+      job_pool[j].requests = requests[1];
+      job_pool[j].results = results[0];
+      job_pool[j].busy = 0;
+   }
+}
+
+/*Stops the jobs: closing its pipe of races ends a job*/
+void stop_jobs()
+{
+   int j, status;
+
+   for(j = 0; j < jobs; j++)
+   {
+      close(job_pool[j].requests);
+      close(job_pool[j].results);
+      waitpid(job_pool[j].pid, &status, 0);
+      if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      {
+         printf("\nJob %d failed.\n", j);
+         exit(1);
+      }
+   }
+   free(job_pool);
+}
+
+/*Runs the races a job gets, until the server closes its pipe. Every race is headless, silent and runs on a single lockstep worker, 
+in the arena of the races before it. Never returns*/
+void run_job(int requests, int results)
+{
+   RaceSpec spec;
+   RaceResult outcome;
+   struct timespec begin, end;
+
+   engine = LOCKSTEP_ENGINE;
+   workers = 1;
+   fast = quiet = serving = 1;
+   logging = 0;
+   result = &outcome;
+   /*A RaceSpec and a RaceResult are smaller than PIPE_BUF, so each one is read and written at once*/
+   while(read(requests, &spec, sizeof(spec)) == sizeof(spec))
+   {
+      track_size = spec.track_size;
+      total_cyclists = spec.cyclists;
+      mode = spec.mode;
+      grid = spec.grid;
+      heat_size = spec.heat_size;
+      seed = spec.seed;
+      sparse = spec.sparse;
+      outcome.spec = spec;
+      clock_gettime(CLOCK_MONOTONIC, &begin);
+      run_race();
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      outcome.wall = end.tv_sec - begin.tv_sec + (end.tv_nsec - begin.tv_nsec) / 1000000000.0;
+      if(write(results, &outcome, sizeof(outcome)) != sizeof(outcome)) _exit(1);
+   }
+   _exit(0);
+}
+
+/*Reports the race that just ended*/
+void record_result(RaceResult *r)
+{
+   int i;
+
+   r->broken = 0;
+   for(i = 0; i < total_cyclists; i++)
+   {
+      if(peloton.place[i] <= 3) r->podium[peloton.place[i] - 1] = peloton.number[i];
+      r->broken += (peloton.status[i] & BROKEN) != 0;
+   }
+   r->ticks = ticks;
+   r->laps = laps;
+}
+
+/*Accepts a client of the socket. A client beyond SERVER_CLIENTS is turned away*/
+void accept_client(int listener)
+{
+   int c, fd = accept(listener, NULL, NULL);
+
+   if(fd < 0) return;
+   for(c = 0; c < SERVER_CLIENTS && clients[c].out >= 0; c++);
+   if(c == SERVER_CLIENTS)
+   {
+      close(fd);
+      return;
+   }
+   clients[c].in = clients[c].out = fd;
+   clients[c].generation++;
+   clients[c].lines = clients[c].running = 0;
+   clients[c].length = 0;
+}
+
+/*Reads what a client sent and takes every whole line. At the end of its input, the client is closed once all its races are answered*/
+void read_client(int c)
+{
+   Client *client = &clients[c];
+   char *newline;
+   long n = read(client->in, client->line + client->length, SPEC_BYTES - 1 - client->length);
+
+   if(n <= 0)
+   {
+      /*The last line may have no newline*/
+      if(client->length > 0)
+      {
+         client->line[client->length] = '\0';
+         client->length = 0;
+         take_line(c, client->line);
+      }
+      client->in = -1;
+      if(client->out >= 0 && client->running == 0) close_client(c);
+      return;
+   }
+   client->length += n;
+   client->line[client->length] = '\0';
+   while(client->out >= 0 && (newline = strchr(client->line, '\n')) != NULL)
+   {
+      *newline = '\0';
+      take_line(c, client->line);
+      client->length -= newline + 1 - client->line;
+      memmove(client->line, newline + 1, client->length + 1);
+   }
+   /*A line that does not fit is taken in pieces (none of them a race)*/
+   if(client->out >= 0 && client->length == SPEC_BYTES - 1)
+   {
+      client->length = 0;
+      take_line(c, client->line);
+   }
+}
+
+/*Takes a line of a client: queues its race, or answers at once if it is not one. Empty lines are skipped.
+The id of a race is its number among the lines of its client that are not empty*/
+void take_line(int c, char *line)
+{
+   Client *client = &clients[c];
+   RaceSpec spec;
+   const char *error;
+   char text[RESULT_BYTES];
+
+   if(line[strspn(line, " \t\r")] == '\0') return;
+   client->lines++;
+   error = parse_spec(line, &spec);
+   if(error != NULL)
+   {
+      sprintf(text, "%ld\terror\t%s\n", client->lines, error);
+      send_line(c, text);
+      return;
+   }
+   spec.id = client->lines;
+   spec.client = c;
+   spec.generation = client->generation;
+   client->running++;
+   enqueue(&spec);
+}
+
+/*Parses a race: d n u|v [--seed s] [--grid random|ranked|heats] [--heat-size h]. Returns NULL, or what is wrong with it.
+The checks are the ones of input_checker(), get_mode() and get_options(), which exit instead. Without --seed, the seed is the time*/
+const char *parse_spec(char *line, RaceSpec *spec)
+{
+   char *word[3], *option, *value;
+   int i;
+
+   for(i = 0; i < 3; i++)
+      if((word[i] = strtok(i == 0 ? line : NULL, " \t\r")) == NULL) return "a race is d n u|v [options]";
+   if(atoi(word[0]) <= MINIMUM_METERS) return "the track is expected to have more than 249m";
+   if(atol(word[0]) > MAXIMUM_METERS) return "the track is too long";
+   if(atoi(word[1]) <= MINIMUM_CYCLISTS) return "there must be more than 3 competitors";
+   if(strcasecmp(word[2], "u") != 0 && strcasecmp(word[2], "v") != 0) return "mode is expected to be u or v";
+   spec->track_size = atoi(word[0]);
+   /*At most a cyclist every 2 meters*/
+   spec->cyclists = atoi(word[1]);
+   if(spec->cyclists > (spec->track_size + 1) / 2) spec->cyclists = (spec->track_size + 1) / 2;
+   spec->mode = (word[2][0] == 'u' || word[2][0] == 'U') ? 'u' : 'v';
+   spec->grid = RANDOM_GRID;
+   spec->heat_size = HEAT_SIZE;
+   spec->seed = time(NULL);
+   spec->sparse = 0;
+
+   while((option = strtok(NULL, " \t\r")) != NULL)
+   {
+      value = strtok(NULL, " \t\r");
+      if(value == NULL) return "an option has no value";
+      if(strcmp(option, "--seed") == 0) spec->seed = strtoul(value, NULL, 10);
+      else if(strcmp(option, "--grid") == 0)
+      {
+         if(strcmp(value, "random") == 0) spec->grid = RANDOM_GRID;
+         else if(strcmp(value, "ranked") == 0) spec->grid = RANKED_GRID;
+         else if(strcmp(value, "heats") == 0) spec->grid = HEATS_GRID;
+         else return "the starting grid must be random, ranked or heats";
+      }
+      else if(strcmp(option, "--heat-size") == 0)
+      {
+         spec->grid = HEATS_GRID;
+         spec->heat_size = atoi(value);
+         if(spec->heat_size < 1) return "a heat must have at least 1 cyclist";
+      }
+      else if(strcmp(option, "--track") == 0)
+      {
+         if(strcmp(value, "dense") == 0) spec->sparse = 0;
+         else if(strcmp(value, "sparse") == 0) spec->sparse = 1;
+         else return "the track must be dense or sparse";
+      }
+      else return "unknown option";
+   }
+   return NULL;
+}
+
+/*Hands the oldest races of the queue to the idle jobs. The races of a client that left are not run*/
+void dispatch()
+{
+   RaceSpec spec;
+   int j;
+
+   for(j = 0; j < jobs && queue.count > 0; j++)
+   {
+      if(job_pool[j].busy) continue;
+      dequeue(&spec);
+      if(clients[spec.client].out < 0 || clients[spec.client].generation != spec.generation) 
+      {
+         j--;
+         continue;
+      }
+      if(write(job_pool[j].requests, &spec, sizeof(spec)) != sizeof(spec))
+      {
+         printf("\nJob %d failed.\n", j);
+         exit(1);
+      }
+      job_pool[j].busy = 1;
+   }
+}
+
+/*Reads the result of the race a job ran, and writes it to the client that asked for it (if it is still there), as a line of tab separated fields:
+id, "ok", d, n, mode, seed, the numbers of the 1st, 2nd and 3rd places, cyclists broken, duration of the race (in cycles and in seconds) 
+and seconds the job took to run it*/
+void collect_result(Job *job)
+{
+   RaceResult r;
+   Client *client;
+   char text[RESULT_BYTES];
+
+   if(read(job->results, &r, sizeof(r)) != sizeof(r))
+   {
+      printf("\nJob %d failed.\n", (int)(job - job_pool));
+      exit(1);
+   }
+   job->busy = 0;
+   client = &clients[r.spec.client];
+   if(client->out < 0 || client->generation != r.spec.generation) return;
+   sprintf(text, "%ld\tok\t%d\t%d\t%c\t%lu\t%d\t%d\t%d\t%d\t%ld\t%.1f\t%.6f\n", r.spec.id, r.spec.track_size, r.spec.cyclists, r.spec.mode, r.spec.seed, 
+      r.podium[0], r.podium[1], r.podium[2], r.broken, r.ticks, (double)r.ticks * CYCLE_NSEC / 1000000000.0, r.wall);
+   send_line(r.spec.client, text);
+   if(client->out >= 0 && --client->running == 0 && client->in < 0) close_client(r.spec.client);
+}
+
+/*Writes a line to a client. A client that can not be written to is closed*/
+void send_line(int c, const char *text)
+{
+   long length = strlen(text), written;
+
+   while(length > 0)
+   {
+      written = write(clients[c].out, text, length);
+      if(written <= 0)
+      {
+         close_client(c);
+         return;
+      }
+      text += written;
+      length -= written;
+   }
+}
+
+/*Closes a client. The standard output stays open*/
+void close_client(int c)
+{
+   if(clients[c].out != STDOUT_FILENO) close(clients[c].out);
+   clients[c].in = clients[c].out = -1;
+}
+
+/*Puts a race at the end of the queue*/
+void enqueue(RaceSpec *spec)
+{
+   RaceSpec *specs;
+   long i, size = queue.size > 0 ? 2 * queue.size : 64;
+
+   if(queue.count == queue.size)
+   {
+      specs = malloc(size * sizeof(RaceSpec));
+      for(i = 0; i < queue.count; i++) specs[i] = queue.specs[(queue.first + i) % queue.size];
+      free(queue.specs);
+      queue.specs = specs;
+      queue.first = 0;
+      queue.size = size;
+   }
+   queue.specs[(queue.first + queue.count) % queue.size] = *spec;
+   queue.count++;
+}
+
+/*Takes the race at the front of the queue*/
+void dequeue(RaceSpec *spec)
+{
+   *spec = queue.specs[queue.first];
+   queue.first = (queue.first + 1) % queue.size;
+   queue.count--;
+}
+
+/*Returns the number of laps the cyclists completed*/
+long count_laps()
+{
+   int i;
+   long completed = 0;
+   for(i = 0; i < total_cyclists; i++) completed += peloton.lap[i] - 1;
+   return completed;
+}
+
+#ifdef BENCHMARK
+/*Benchmark of the race engine (make bench). Runs headless races for every mode, track size and number of cyclists of the sweep.
+Races run in lockstep on a single worker or, if a number of workers is given (the second argument), in the segment engine. With "c" instead they run in the cruise engine.
+Prints a header and one tab separated line per race. Races longer than the move budget (the first argument, BENCH_MOVES by default) are stopped there, with finished = 0*/
+int benchmark(int argc, char **argv)
+{
+   static const int tracks[] = {250, 1000, 10000, 100000};
+   static const char modes[] = {'u', 'v'};
+   int t, m, cyclists, max_cyclists;
+
+   move_budget = BENCH_MOVES;
+   engine = LOCKSTEP_ENGINE;
+   workers = 1;
+   if(argc > 1) move_budget = atol(argv[1]);
+   if(argc > 2 && strcmp(argv[2], "c") == 0) engine = CRUISE_ENGINE;
+   else if(argc > 2)
+   {
+      engine = SEGMENT_ENGINE;
+      workers = atoi(argv[2]);
+   }
+   if(argc > 3 || move_budget < 1 || workers < 1) {
+      printf("The format entrance is [moves per race [segment workers | c]].\n");
+      exit(-1);
+   }
+
+   fast = quiet = 1;
+   logging = batch = 0;
+   totals = NULL;
+   grid = RANDOM_GRID;
+
+   printf("engine\tworkers\tmode\ttrack\tcyclists\tticks\tmoves\tlaps\tfinished\tseconds\tmoves_per_sec\tlaps_per_sec\n");
+   for(m = 0; m < 2; m++)
+      for(t = 0; t < 4; t++)
+      {
+         /*From 4 cyclists up to the most the track takes (see input_checker())*/
+         max_cyclists = (tracks[t] + 1) / 2;
+         for(cyclists = MINIMUM_CYCLISTS + 1; cyclists < max_cyclists; cyclists *= 4) bench_race(modes[m], tracks[t], cyclists);
+         bench_race(modes[m], tracks[t], max_cyclists);
+      }
+   return 0;
+}
+
+/*Runs and times one benchmark race*/
+void bench_race(char race_mode, int track, int cyclists)
+{
+   struct timespec begin, end;
+   double seconds;
+
+   mode = race_mode;
+   track_size = track;
+   total_cyclists = cyclists;
+   seed = BENCH_SEED;
+
+   clock_gettime(CLOCK_MONOTONIC, &begin);
+   run_race();
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1000000000.0;
+
+   printf("%c\t%d\t%c\t%d\t%d\t%ld\t%ld\t%ld\t%d\t%.6f\t%.0f\t%.0f\n", engine, workers, mode, track_size, total_cyclists, ticks, moves, laps, !halted, seconds, moves / seconds, laps / seconds);
+   fflush(stdout);
+}
+#endif
+
+#ifdef INSTRUMENT
+/*Returns the counters of the running thread, registering them the first time*/
+ThreadStats *thread_stats()
+{
+   if(my_stats == NULL)
+   {
+      my_stats = calloc(1, sizeof(ThreadStats));
+      pthread_mutex_lock(&stats_lock);
+         my_stats->next = all_stats;
+         all_stats = my_stats;
+      pthread_mutex_unlock(&stats_lock);
+   }
+   return my_stats;
+}
+
+/*The running thread starts waiting in the probe*/
+void probe_begin(int probe)
+{
+   clock_gettime(CLOCK_MONOTONIC, &thread_stats()->begin[probe]);
+}
+
+/*The running thread stops waiting in the probe*/
+void probe_end(int probe)
+{
+   ThreadStats *stats = thread_stats();
+   struct timespec end;
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   stats->probe[probe].passes++;
+   record_wait(&stats->probe[probe], (end.tv_sec - stats->begin[probe].tv_sec) * 1000000000UL + end.tv_nsec - stats->begin[probe].tv_nsec);
+}
+
+/*Adds a wait of nsec nanoseconds to the probe*/
+void record_wait(Probe *probe, unsigned long nsec)
+{
+   probe->waits++;
+   probe->nsec += nsec;
+   if(nsec > probe->max_nsec) probe->max_nsec = nsec;
+   probe->histogram[histogram_bucket(nsec)]++;
+}
+
+/*Locks the mutex. Only a lock that is already taken is timed, so an uncontended lock costs a single trylock*/
+int probed_lock(pthread_mutex_t *lock, int probe)
+{
+   ThreadStats *stats = thread_stats();
+   int result;
+
+   if(pthread_mutex_trylock(lock) == 0)
+   {
+      stats->probe[probe].passes++;
+      return 0;
+   }
+   probe_begin(probe);
+   result = pthread_mutex_lock(lock);
+   probe_end(probe);
+   return result;
+}
+
+/*Waits in the barrier. Every wait is timed: it is the time the thread spent waiting for the slowest worker of the phase*/
+int probed_barrier_wait(pthread_barrier_t *barrier)
+{
+   int result;
+   probe_begin(PROBE_BARRIER);
+   result = pthread_barrier_wait(barrier);
+   probe_end(PROBE_BARRIER);
+   return result;
+}
+
+/*Counts a tick in which n moves were made*/
+void count_moves(long n)
+{
+   thread_stats()->moves[histogram_bucket(n)]++;
+}
+
+/*Returns the histogram bucket of a value*/
+int histogram_bucket(unsigned long value)
+{
+   int bucket = 0;
+   while(value > 1 && bucket < HISTOGRAM_BUCKETS - 1)
+   {
+      value >>= 1;
+      bucket++;
+   }
+   return bucket;
+}
+
+/*Clears the counters of every thread, before a race. The counters of threads that are gone are kept for the next threads*/
+void reset_stats()
+{
+   ThreadStats *stats;
+   pthread_mutex_lock(&stats_lock);
+      for(stats = all_stats; stats != NULL; stats = stats->next)
+      {
+         memset(stats->probe, 0, sizeof(stats->probe));
+         memset(stats->moves, 0, sizeof(stats->moves));
+      }
+   pthread_mutex_unlock(&stats_lock);
+   dump_requested = 0;
+}
+
+/*Writes the counters of all the threads, added up, in the standard error. During the race the counters of the other threads may be a few updates behind*/
+void dump_stats()
+{
+   static const char *names[PROBES] = {"field wait", "standings lock", "tick barrier", "logger sleep", "ring full"};
+   Probe total;
+   ThreadStats *stats;
+   unsigned long moves_histogram[HISTOGRAM_BUCKETS];
+   int p, b, threads = 0;
+
+   memset(moves_histogram, 0, sizeof(moves_histogram));
+   pthread_mutex_lock(&stats_lock);
+      for(stats = all_stats; stats != NULL; stats = stats->next)
+      {
+         threads++;
+         for(b = 0; b < HISTOGRAM_BUCKETS; b++) moves_histogram[b] += stats->moves[b];
+      }
+      fprintf(stderr, "\nINSTRUMENTATION (tick %ld, %d threads):\n", ticks, threads);
+      fprintf(stderr, "%-17s %12s %12s %14s %12s %12s\n", "probe", "passes", "waits", "waited (us)", "mean (ns)", "max (ns)");
+      for(p = 0; p < PROBES; p++)
+      {
+         memset(&total, 0, sizeof(total));
+         for(stats = all_stats; stats != NULL; stats = stats->next)
+         {
+            total.passes += stats->probe[p].passes;
+            total.waits += stats->probe[p].waits;
+            total.nsec += stats->probe[p].nsec;
+            if(stats->probe[p].max_nsec > total.max_nsec) total.max_nsec = stats->probe[p].max_nsec;
+            for(b = 0; b < HISTOGRAM_BUCKETS; b++) total.histogram[b] += stats->probe[p].histogram[b];
+         }
+         fprintf(stderr, "%-17s %12lu %12lu %14lu %12lu %12lu\n", names[p], total.passes, total.waits, total.nsec / 1000, total.waits ? total.nsec / total.waits : 0, total.max_nsec);
+         if(total.waits == 0) continue;
+         fprintf(stderr, "   waits by duration (ns):");
+         for(b = 0; b < HISTOGRAM_BUCKETS; b++) if(total.histogram[b]) fprintf(stderr, " <%lu:%lu", 2UL << b, total.histogram[b]);
+         fprintf(stderr, "\n");
+      }
+   pthread_mutex_unlock(&stats_lock);
+   fprintf(stderr, "ticks by moves:");
+   for(b = 0; b < HISTOGRAM_BUCKETS; b++) if(moves_histogram[b]) fprintf(stderr, " <%lu:%lu", 2UL << b, moves_histogram[b]);
+   fprintf(stderr, "\n");
+}
+
+/*SIGUSR1 handler. Only asks for a dump: printing is not safe in a signal handler*/
+void request_dump(int signal)
+{
+   dump_requested = 1;
+}
+
+/*Dumps the counters if SIGUSR1 was received. Called by the chronometer once per cycle*/
+void check_dump_request()
+{
+   if(!dump_requested) return;
+   dump_requested = 0;
+   dump_stats();
+}
+#endif
+
+/*Takes a snapshot of the race at the end of a tick, run by a single worker while the others wait in the barrier. 
+The state is only copied in memory here; snapshot_thread writes it. If the last snapshot is still being written, this one is skipped*/
+void take_snapshot()
+{
+   SnapshotHeader header;
+   char *buffer, *p;
+   size_t size, cyclists = total_cyclists;
+   unsigned int slot;
+   Meter *cell;
+   int i, *meters;
+
+   if(__atomic_load_n(&snapshot_writing, __ATOMIC_ACQUIRE)) return;
+   if(snapshot_started) pthread_join(snapshot_thread, NULL);
+   next_snapshot = ticks + snapshot_every;
+
+   memset(&header, 0, sizeof(header));
+   strcpy(header.magic, SNAPSHOT_MAGIC);
+   header.version = SNAPSHOT_VERSION;
+   header.mode = mode;
+   header.track_size = track_size;
+   header.total_cyclists = total_cyclists;
+   header.cyclists_competing = race.competing;
+   header.standings_competing = standings.competing;
+   header.try_to_break = race.try_to_break;
+   header.eliminated = race.eliminated;
+   header.rules = RULES;
+   header.finished = race.finished;
+   header.seed = seed;
+   header.ticks = ticks;
+   header.moves = moves;
+   header.events = logged_events + (logging ? events.head : 0);
+   header.clock = race_clock();
+   /*The meters are written in order, whatever the track. The ones of a sparse track are taken from its slots and sorted, 
+   so a snapshot costs the cyclists, not the length of the track. Every occupied meter has a cyclist*/
+   meters = malloc(cyclists * sizeof(int));
+   if(sparse) 
+   {
+      for(slot = 0; slot <= sparse_track.mask; slot++) 
+         if(sparse_track.slots[slot].meter.occupancy) meters[header.occupied_meters++] = sparse_track.slots[slot].key - 1;
+      qsort(meters, header.occupied_meters, sizeof(int), by_meter);
+   }
+   else for(i = 0; i < track_size; i++) if(track[i].occupancy) meters[header.occupied_meters++] = i;
+
+   size = sizeof(header) + cyclists * (7 * sizeof(int) + sizeof(unsigned char) + sizeof(clock_t) + sizeof(int) + sizeof(Rng) + sizeof(int) + sizeof(int) + sizeof(long) + sizeof(int) + sizeof(char)) 
+        + sizeof(sprinters) + header.occupied_meters * (sizeof(int) + sizeof(Meter));
+   buffer = malloc(size);
+   p = buffer;
+   memcpy(p, &header, sizeof(header)); p += sizeof(header);
+   memcpy(p, peloton.position, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.place, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.speed, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.velocity, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.accel, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.fatigue, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.lap, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.status, cyclists * sizeof(unsigned char)); p += cyclists * sizeof(unsigned char);
+   memcpy(p, peloton.cyclist_timer, cyclists * sizeof(clock_t)); p += cyclists * sizeof(clock_t);
+   memcpy(p, peloton.number, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, peloton.rng, cyclists * sizeof(Rng)); p += cyclists * sizeof(Rng);
+   memcpy(p, peloton.points, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, standings.rank, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, standings.distance, cyclists * sizeof(long)); p += cyclists * sizeof(long);
+   memcpy(p, intent, cyclists * sizeof(int)); p += cyclists * sizeof(int);
+   memcpy(p, retired, cyclists * sizeof(char)); p += cyclists * sizeof(char);
+   memcpy(p, sprinters, sizeof(sprinters)); p += sizeof(sprinters);
+   for(i = 0; i < header.occupied_meters; i++)
+   {
+      cell = find_meter(meters[i]);
+      memcpy(p, &meters[i], sizeof(int)); p += sizeof(int);
+      memcpy(p, cell, sizeof(Meter)); p += sizeof(Meter);
+   }
+   free(meters);
+
+   /*The buffer is freed by the writer*/
+   snapshot_size = size;
+   snapshot_writing = snapshot_started = 1;
+   if(pthread_create(&snapshot_thread, NULL, write_snapshot, buffer))
+   {
+      printf("Error creating snapshot thread.");
+      abort();
+   }
+}
+
+/*Orders meter numbers (qsort)*/
+int by_meter(const void *a, const void *b)
+{
+   return *(const int*)a - *(const int*)b;
+}
+
+/*Writes a snapshot taken by take_snapshot(). It is written in a temporary file first, so a crash while writing leaves the last snapshot intact.
+It replaces the last snapshot once the logger wrote every event before it, so the binary log is never behind the snapshot*/
+void *write_snapshot(void *args)
+{
+   char *buffer = args;
+   FILE *pfile = fopen(SNAPSHOT_FILE ".tmp", "wb");
+   long logged = ((SnapshotHeader*)buffer)->events;
+
+   if(pfile == NULL || fwrite(buffer, snapshot_size, 1, pfile) != 1 || fflush(pfile) != 0 || fsync(fileno(pfile)) != 0 || fclose(pfile) != 0)
+   {
+      printf("\nCould not write %s.\n", SNAPSHOT_FILE);
+      exit(1);
+   }
+   while(logging && __atomic_load_n(&flushed_events, __ATOMIC_ACQUIRE) < logged) await(SNAPSHOT_NAP_NSEC);
+   if(rename(SNAPSHOT_FILE ".tmp", SNAPSHOT_FILE) != 0)
+   {
+      printf("\nCould not write %s.\n", SNAPSHOT_FILE);
+      exit(1);
+   }
+   free(buffer);
+   __atomic_store_n(&snapshot_writing, 0, __ATOMIC_RELEASE);
+   return NULL;
+}
+
+/*Waits for the last snapshot to be written, at the end of the race*/
+void finish_snapshots()
+{
+   if(snapshot_started) pthread_join(snapshot_thread, NULL);
+   snapshot_started = 0;
+}
+
+/*Restores the race from a snapshot. The cyclists, the track and the standings were made as for a new race, and are overwritten*/
+void load_snapshot(const char *file)
+{
+   SnapshotHeader header;
+   FILE *pfile = fopen(file, "rb");
+   size_t cyclists = total_cyclists;
+   int i, meter;
+
+   if(pfile == NULL)
+   {
+      printf("\nCould not open %s.\n", file);
+      exit(1);
+   }
+   read_snapshot(pfile, &header, sizeof(header), file);
+   if(strcmp(header.magic, SNAPSHOT_MAGIC) != 0 || header.version != SNAPSHOT_VERSION)
+   {
+      printf("\n%s is not a snapshot of version %d.\n", file, SNAPSHOT_VERSION);
+      exit(1);
+   }
+   if(header.mode != mode || header.track_size != track_size || header.total_cyclists != total_cyclists)
+   {
+      printf("\n%s is a snapshot of a race of %d cyclists on %dm in mode %c.\n", file, header.total_cyclists, header.track_size, (char)header.mode);
+      exit(1);
+   }
+   if(header.rules != RULES)
+   {
+      printf("\n%s is a snapshot of a race with other rules (this is the %s race).\n", file, RULES_NAME);
+      exit(1);
+   }
+
+   race.competing = header.cyclists_competing;
+   standings.competing = header.standings_competing;
+   race.try_to_break = header.try_to_break;
+   race.eliminated = header.eliminated;
+   race.finished = header.finished;
+   seed = header.seed;
+   ticks = header.ticks;
+   moves = header.moves;
+   logged_events = header.events;
+   clock_offset = header.clock;
+   next_snapshot = ticks + snapshot_every;
+
+   read_snapshot(pfile, peloton.position, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.place, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.speed, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.velocity, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.accel, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.fatigue, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.lap, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.status, cyclists * sizeof(unsigned char), file);
+   read_snapshot(pfile, peloton.cyclist_timer, cyclists * sizeof(clock_t), file);
+   read_snapshot(pfile, peloton.number, cyclists * sizeof(int), file);
+   read_snapshot(pfile, peloton.rng, cyclists * sizeof(Rng), file);
+   read_snapshot(pfile, peloton.points, cyclists * sizeof(int), file);
+   read_snapshot(pfile, standings.rank, cyclists * sizeof(int), file);
+   read_snapshot(pfile, standings.distance, cyclists * sizeof(long), file);
+   read_snapshot(pfile, intent, cyclists * sizeof(int), file);
+   read_snapshot(pfile, retired, cyclists * sizeof(char), file);
+   read_snapshot(pfile, sprinters, sizeof(sprinters), file);
+
+   clear_track();
+   for(i = 0; i < header.occupied_meters; i++)
+   {
+      read_snapshot(pfile, &meter, sizeof(int), file);
+      if(meter < 0 || meter >= track_size)
+      {
+         printf("\n%s is corrupted.\n", file);
+         exit(1);
+      }
+      read_snapshot(pfile, claim_meter(meter), sizeof(Meter), file);
+   }
+   fclose(pfile);
+
+   if(!quiet) printf("\nResuming from %s: seed %lu, cycle %ld, %d cyclists competing.\n", file, seed, ticks, cyclists_competing());
+   print_cyclists();
+}
+
+/*Reads a part of a snapshot*/
+void read_snapshot(FILE *pfile, void *data, size_t size, const char *file)
+{
+   if(fread(data, size, 1, pfile) != 1)
+   {
+      printf("\n%s is truncated.\n", file);
+      exit(1);
+   }
+}
+
+/*Work of a single worker at the end of every tick of the lockstep and segment engines, once the state of the race is settled*/
+void tick_done()
+{
+   if(sparse) free_vacated_meters();
+   if(tracing) trace_frame();
+   if(snapshot_every > 0 && ticks >= next_snapshot) take_snapshot();
+}
+
+/*Creates the trace, with the header, the numbers of the cyclists and the frame of the current state of the race*/
+void open_trace()
+{
+   int i;
+   int32_t number;
+
+   tracer.fd = open(TRACE_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if(tracer.fd < 0)
+   {
+      printf("\nCould not open %s.\n", TRACE_FILE);
+      exit(1);
+   }
+   memset(&tracer.header, 0, sizeof(TraceHeader));
+   strcpy(tracer.header.magic, TRACE_MAGIC);
+   tracer.header.version = TRACE_VERSION;
+   tracer.header.mode = mode;
+   tracer.header.total_cyclists = total_cyclists;
+   tracer.header.track_size = track_size;
+   tracer.header.keyframe_every = KEYFRAME_EVERY;
+   tracer.header.units = POSITION_UNITS;
+   tracer.header.first_tick = ticks;
+   if(write(tracer.fd, &tracer.header, sizeof(TraceHeader)) != sizeof(TraceHeader))
+   {
+      printf("\nCould not write %s.\n", TRACE_FILE);
+      exit(1);
+   }
+   for(i = 0; i < total_cyclists; i++)
+   {
+      number = peloton.number[i];
+      if(write(tracer.fd, &number, sizeof(number)) != sizeof(number))
+      {
+         printf("\nCould not write %s.\n", TRACE_FILE);
+         exit(1);
+      }
+   }
+
+   tracer.offset = sizeof(TraceHeader) + total_cyclists * sizeof(int32_t);
+   tracer.frames = 0;
+   tracer.keyframes_size = 64;
+   tracer.keyframes = malloc(tracer.keyframes_size * sizeof(int64_t));
+   tracer.previous_position = malloc(total_cyclists * sizeof(int));
+   tracer.previous_lap = malloc(total_cyclists * sizeof(int));
+   tracer.previous_place = malloc(total_cyclists * sizeof(int));
+   /*The window holds the biggest frame, wherever it starts in its first page*/
+   tracer.max_frame = 1 + VARINT_BYTES + (long)total_cyclists * 4 * VARINT_BYTES;
+   tracer.window_size = TRACE_WINDOW;
+   while(tracer.window_size < tracer.max_frame + sysconf(_SC_PAGESIZE)) tracer.window_size *= 2;
+   tracer.window = NULL;
+   slide_trace_window(tracer.offset);
+
+   trace_frame();
+}
+
+/*Writes the frame of the current cycle*/
+void trace_frame()
+{
+   unsigned char *p, *count_at;
+   int i, changed = 0, last = -1;
+
+   if(tracer.offset + tracer.max_frame > tracer.window_offset + tracer.window_size) slide_trace_window(tracer.offset);
+   p = tracer.window + (tracer.offset - tracer.window_offset);
+
+   if(tracer.frames % KEYFRAME_EVERY == 0)
+   {
+      if(tracer.frames / KEYFRAME_EVERY == tracer.keyframes_size)
+      {
+         tracer.keyframes_size *= 2;
+         tracer.keyframes = realloc(tracer.keyframes, tracer.keyframes_size * sizeof(int64_t));
+      }
+      tracer.keyframes[tracer.frames / KEYFRAME_EVERY] = tracer.offset;
+      *p++ = TRACE_KEYFRAME;
+      for(i = 0; i < total_cyclists; i++)
+      {
+         p = put_varint(p, peloton.position[i]);
+         p = put_varint(p, peloton.lap[i]);
+         p = put_varint(p, peloton.place[i]);
+      }
+   }
+   else
+   {
+      *p++ = TRACE_DELTA;
+      /*The count is only known at the end: its bytes are reserved and filled with a padded varint*/
+      count_at = p;
+      p += VARINT_BYTES;
+      for(i = 0; i < total_cyclists; i++)
+      {
+         if(peloton.position[i] == tracer.previous_position[i] && peloton.lap[i] == tracer.previous_lap[i] && peloton.place[i] == tracer.previous_place[i]) continue;
+         p = put_varint(p, i - last - 1);
+         p = put_varint(p, zigzag(peloton.position[i] - tracer.previous_position[i]));
+         p = put_varint(p, zigzag(peloton.lap[i] - tracer.previous_lap[i]));
+         p = put_varint(p, zigzag(peloton.place[i] - tracer.previous_place[i]));
+         last = i;
+         changed++;
+      }
+      for(i = 0; i < VARINT_BYTES - 1; i++, changed >>= 7) count_at[i] = (changed & 0x7f) | 0x80;
+      count_at[i] = changed;
+   }
+
+   memcpy(tracer.previous_position, peloton.position, total_cyclists * sizeof(int));
+   memcpy(tracer.previous_lap, peloton.lap, total_cyclists * sizeof(int));
+   memcpy(tracer.previous_place, peloton.place, total_cyclists * sizeof(int));
+   tracer.offset = tracer.window_offset + (p - tracer.window);
+   tracer.frames++;
+}
+
+/*Maps a new window of the trace, from the page of offset on, growing the file to hold it*/
+void slide_trace_window(long offset)
+{
+   long page = sysconf(_SC_PAGESIZE);
+
+   if(tracer.window != NULL) munmap(tracer.window, tracer.window_size);
+   tracer.window_offset = offset / page * page;
+   if(ftruncate(tracer.fd, tracer.window_offset + tracer.window_size) != 0)
+   {
+      printf("\nCould not grow %s.\n", TRACE_FILE);
+      exit(1);
+   }
+   tracer.window = mmap(NULL, tracer.window_size, PROT_READ | PROT_WRITE, MAP_SHARED, tracer.fd, tracer.window_offset);
+   if(tracer.window == MAP_FAILED)
+   {
+      printf("\nCould not map %s.\n", TRACE_FILE);
+      exit(1);
+   }
+}
+
+/*Finishes the trace: cuts the unused end of the window, then writes the index and the final header*/
+void close_trace()
+{
+   long keyframes = (tracer.frames + KEYFRAME_EVERY - 1) / KEYFRAME_EVERY;
+
+   munmap(tracer.window, tracer.window_size);
+   tracer.header.frames = tracer.frames;
+   tracer.header.keyframes = keyframes;
+   tracer.header.index_offset = tracer.offset;
+   if(ftruncate(tracer.fd, tracer.offset) != 0 
+      || pwrite(tracer.fd, tracer.keyframes, keyframes * sizeof(int64_t), tracer.offset) != (ssize_t)(keyframes * sizeof(int64_t))
+      || pwrite(tracer.fd, &tracer.header, sizeof(TraceHeader), 0) != sizeof(TraceHeader))
+   {
+      printf("\nCould not write %s.\n", TRACE_FILE);
+      exit(1);
+   }
+   close(tracer.fd);
+   free(tracer.keyframes);
+   free(tracer.previous_position);
+   free(tracer.previous_lap);
+   free(tracer.previous_place);
+}
+
+/*Writes a varint. Returns the byte after it*/
+unsigned char *put_varint(unsigned char *p, uint32_t value)
+{
+   while(value >= 0x80)
+   {
+      *p++ = (value & 0x7f) | 0x80;
+      value >>= 7;
+   }
+   *p++ = value;
+   return p;
+}
+
+/*Zigzag encoding of a difference: small negative and positive numbers get small codes*/
+uint32_t zigzag(int value)
+{
+   return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+/*Opens the telemetry socket and starts the publisher thread*/
+void start_telemetry()
+{
+   struct sockaddr_un address;
+   TelemetryHeader header;
+   uint32_t length;
+   int32_t number;
+   unsigned char *p;
+   int i;
+
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, TELEMETRY_SOCKET);
+   unlink(TELEMETRY_SOCKET);
+   telemetry.listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(telemetry.listener < 0 || bind(telemetry.listener, (struct sockaddr*)&address, sizeof(address)) != 0 
+      || listen(telemetry.listener, TELEMETRY_SUBSCRIBERS) != 0 || fcntl(telemetry.listener, F_SETFL, O_NONBLOCK) != 0)
+   {
+      printf("\nCould not open %s.\n", TELEMETRY_SOCKET);
+      exit(1);
+   }
+   for(i = 0; i < TELEMETRY_SUBSCRIBERS; i++) telemetry.subscriber[i].fd = -1;
+
+   telemetry.position = malloc(total_cyclists * sizeof(int));
+   telemetry.lap = malloc(total_cyclists * sizeof(int));
+   telemetry.place = malloc(total_cyclists * sizeof(int));
+   telemetry.status = malloc(total_cyclists);
+   telemetry.previous_position = malloc(total_cyclists * sizeof(int));
+   telemetry.previous_lap = malloc(total_cyclists * sizeof(int));
+   telemetry.previous_place = malloc(total_cyclists * sizeof(int));
+   telemetry.previous_status = malloc(total_cyclists);
+   /*The biggest message is a delta frame where every cyclist changed. The hello message is always smaller*/
+   telemetry.max_frame = sizeof(uint32_t) + 1 + 2 * VARINT_BYTES + (long)total_cyclists * 5 * VARINT_BYTES;
+   telemetry.keyframe = malloc(telemetry.max_frame);
+   telemetry.delta = malloc(telemetry.max_frame);
+
+   memset(&header, 0, sizeof(header));
+   strcpy(header.magic, TELEMETRY_MAGIC);
+   header.version = TELEMETRY_VERSION;
+   header.mode = mode;
+   header.total_cyclists = total_cyclists;
+   header.track_size = track_size;
+   header.units = POSITION_UNITS;
+   header.rules = RULES;
+   telemetry.hello_length = sizeof(uint32_t) + 1 + sizeof(header) + total_cyclists * sizeof(int32_t);
+   telemetry.hello = malloc(telemetry.hello_length);
+   length = telemetry.hello_length - sizeof(uint32_t);
+   memcpy(telemetry.hello, &length, sizeof(length));
+   p = telemetry.hello + sizeof(uint32_t);
+   *p++ = TELEMETRY_HELLO;
+   memcpy(p, &header, sizeof(header));
+   p += sizeof(header);
+   for(i = 0; i < total_cyclists; i++, p += sizeof(number))
+   {
+      number = peloton.number[i];
+      memcpy(p, &number, sizeof(number));
+   }
+
+   telemetry.pending = telemetry.closed = 0;
+   telemetry.skipped = telemetry.dropped = 0;
+   if(pthread_mutex_init(&telemetry.lock, NULL) != 0 || pthread_cond_init(&telemetry.wakeup, NULL) != 0)
+   {
+      printf("\nTelemetry initialization failed.\n");
+      exit(1);
+   }
+   if (pthread_create(&telemetry.thread, NULL, omnium_publisher, NULL)) 
+   {
+      printf("Error creating publisher thread.");
+      abort();
+   }
+}
+
+/*Stops the publisher thread, then sends the final state of the race and its end to the subscribers*/
+void stop_telemetry()
+{
+   pthread_mutex_lock(&telemetry.lock);
+      telemetry.closed = 1;
+      pthread_cond_signal(&telemetry.wakeup);
+   pthread_mutex_unlock(&telemetry.lock);
+   if (pthread_join(telemetry.thread, NULL)) 
+   {
+      printf("Error joining publisher thread.");
+      abort();
+   }
+   /*The race is over: the final places are known and nobody else touches the telemetry*/
+   copy_telemetry();
+   publish_frame();
+   end_telemetry();
+   if(!quiet && (telemetry.skipped > 0 || telemetry.dropped > 0)) 
+      printf("\n(Telemetry: %ld cycles skipped, %ld subscribers dropped for not keeping up)\n", telemetry.skipped, telemetry.dropped);
+
+   pthread_cond_destroy(&telemetry.wakeup);
+   pthread_mutex_destroy(&telemetry.lock);
+   free(telemetry.position);
+   free(telemetry.lap);
+   free(telemetry.place);
+   free(telemetry.status);
+   free(telemetry.previous_position);
+   free(telemetry.previous_lap);
+   free(telemetry.previous_place);
+   free(telemetry.previous_status);
+   free(telemetry.hello);
+   free(telemetry.keyframe);
+   free(telemetry.delta);
+}
+
+/*Hands a copy of the cyclists to the publisher. Never waits: if the publisher is busy, the cycle is skipped*/
+void sample_telemetry()
+{
+   if(pthread_mutex_trylock(&telemetry.lock) != 0) 
+   {
+      telemetry.skipped++;
+      return;
+   }
+   if(telemetry.pending) telemetry.skipped++;
+   else
+   {
+      copy_telemetry();
+      telemetry.pending = 1;
+      pthread_cond_signal(&telemetry.wakeup);
+   }
+   pthread_mutex_unlock(&telemetry.lock);
+}
+
+/*Copies the state of the cyclists into the telemetry. Only the status bits of telemetry.h are sent*/
+void copy_telemetry()
+{
+   int i;
+
+   memcpy(telemetry.position, peloton.position, total_cyclists * sizeof(int));
+   memcpy(telemetry.lap, peloton.lap, total_cyclists * sizeof(int));
+   memcpy(telemetry.place, peloton.place, total_cyclists * sizeof(int));
+   for(i = 0; i < total_cyclists; i++) 
+      telemetry.status[i] = ((peloton.status[i] & ELIMINATED) ? TELEMETRY_ELIMINATED : 0) | ((peloton.status[i] & BROKEN) ? TELEMETRY_BROKEN : 0);
+   telemetry.tick = ticks;
+}
+
+/*Telemetry publisher. Sends the copies handed by the chronometer*/
+void *omnium_publisher(void *args)
+{
+   pthread_mutex_lock(&telemetry.lock);
+   while(1)
+   {
+      while(!telemetry.pending && !telemetry.closed) pthread_cond_wait(&telemetry.wakeup, &telemetry.lock);
+      if(!telemetry.pending) break;
+      pthread_mutex_unlock(&telemetry.lock);
+
+      publish_frame();
+
+      pthread_mutex_lock(&telemetry.lock);
+      telemetry.pending = 0;
+   }
+   pthread_mutex_unlock(&telemetry.lock);
+   return NULL;
+}
+
+/*Sends the copy to every subscriber: a delta frame to the ones that got the frame before, a keyframe to the others.
+A subscriber still taking an older frame misses this one, and is dropped after TELEMETRY_PATIENCE frames missed in a row*/
+void publish_frame()
+{
+   long key_length = 0, delta_length = 0;
+   int i, sent = 0;
+   Subscriber *subscriber;
+
+   accept_subscribers();
+   for(i = 0; i < TELEMETRY_SUBSCRIBERS; i++)
+   {
+      subscriber = &telemetry.subscriber[i];
+      if(subscriber->fd < 0) continue;
+      if(!flush_subscriber(subscriber))
+      {
+         if(subscriber->fd < 0) continue;
+         subscriber->synced = 0;
+         if(++subscriber->behind >= TELEMETRY_PATIENCE)
+         {
+            drop_subscriber(subscriber);
+            telemetry.dropped++;
+         }
+         continue;
+      }
+      subscriber->behind = 0;
+      if(subscriber->synced)
+      {
+         if(delta_length == 0) delta_length = encode_delta(telemetry.delta);
+         send_frame(subscriber, telemetry.delta, delta_length);
+      }
+      else
+      {
+         if(key_length == 0) key_length = encode_keyframe(telemetry.keyframe);
+         send_frame(subscriber, telemetry.keyframe, key_length);
+      }
+      sent = 1;
+   }
+   /*Nobody got this frame: the next one is a keyframe for everybody, so the previous state does not matter*/
+   if(!sent) return;
+   memcpy(telemetry.previous_position, telemetry.position, total_cyclists * sizeof(int));
+   memcpy(telemetry.previous_lap, telemetry.lap, total_cyclists * sizeof(int));
+   memcpy(telemetry.previous_place, telemetry.place, total_cyclists * sizeof(int));
+   memcpy(telemetry.previous_status, telemetry.status, total_cyclists);
+}
+
+/*Accepts the subscribers waiting on the socket and sends them the hello message. Subscribers beyond TELEMETRY_SUBSCRIBERS are turned away*/
+void accept_subscribers()
+{
+   Subscriber *subscriber;
+   int fd, i;
+
+   while((fd = accept(telemetry.listener, NULL, NULL)) >= 0)
+   {
+      for(i = 0; i < TELEMETRY_SUBSCRIBERS && telemetry.subscriber[i].fd >= 0; i++);
+      if(i == TELEMETRY_SUBSCRIBERS)
+      {
+         close(fd);
+         continue;
+      }
+      subscriber = &telemetry.subscriber[i];
+      subscriber->fd = fd;
+      subscriber->behind = 0;
+      subscriber->pending = malloc(telemetry.max_frame);
+      subscriber->pending_length = subscriber->pending_sent = 0;
+      send_frame(subscriber, telemetry.hello, telemetry.hello_length);
+      /*The first frame of a subscriber is a keyframe*/
+      subscriber->synced = 0;
+   }
+}
+
+/*Encodes the copy as a keyframe. Returns the length of the message*/
+long encode_keyframe(unsigned char *frame)
+{
+   unsigned char *p = frame + sizeof(uint32_t);
+   uint32_t length;
+   int i;
+
+   *p++ = TELEMETRY_KEYFRAME;
+   p = put_varint(p, telemetry.tick);
+   for(i = 0; i < total_cyclists; i++)
+   {
+      p = put_varint(p, telemetry.position[i]);
+      p = put_varint(p, telemetry.lap[i]);
+      p = put_varint(p, telemetry.place[i]);
+      p = put_varint(p, telemetry.status[i]);
+   }
+   length = p - frame - sizeof(uint32_t);
+   memcpy(frame, &length, sizeof(length));
+   return p - frame;
+}
+
+/*Encodes the copy as a delta frame over the last frame sent. Returns the length of the message*/
+long encode_delta(unsigned char *frame)
+{
+   unsigned char *p = frame + sizeof(uint32_t), *count_at;
+   uint32_t length;
+   int i, changed = 0, last = -1;
+
+   *p++ = TELEMETRY_DELTA;
+   p = put_varint(p, telemetry.tick);
+   /*The count is only known at the end: its bytes are reserved and filled with a padded varint (like in trace_frame())*/
+   count_at = p;
+   p += VARINT_BYTES;
+   for(i = 0; i < total_cyclists; i++)
+   {
+      if(telemetry.position[i] == telemetry.previous_position[i] && telemetry.lap[i] == telemetry.previous_lap[i] 
+         && telemetry.place[i] == telemetry.previous_place[i] && telemetry.status[i] == telemetry.previous_status[i]) continue;
+      p = put_varint(p, i - last - 1);
+      p = put_varint(p, zigzag(telemetry.position[i] - telemetry.previous_position[i]));
+      p = put_varint(p, zigzag(telemetry.lap[i] - telemetry.previous_lap[i]));
+      p = put_varint(p, zigzag(telemetry.place[i] - telemetry.previous_place[i]));
+      p = put_varint(p, zigzag(telemetry.status[i] - telemetry.previous_status[i]));
+      last = i;
+      changed++;
+   }
+   for(i = 0; i < VARINT_BYTES - 1; i++, changed >>= 7) count_at[i] = (changed & 0x7f) | 0x80;
+   count_at[i] = changed;
+   length = p - frame - sizeof(uint32_t);
+   memcpy(frame, &length, sizeof(length));
+   return p - frame;
+}
+
+/*Encodes the end of the race. Returns the length of the message*/
+long encode_end(unsigned char *frame)
+{
+   unsigned char *p = frame + sizeof(uint32_t);
+   uint32_t length;
+
+   *p++ = TELEMETRY_END;
+   p = put_varint(p, telemetry.tick);
+   length = p - frame - sizeof(uint32_t);
+   memcpy(frame, &length, sizeof(length));
+   return p - frame;
+}
+
+/*Sends a message to a subscriber without waiting. The bytes its socket does not take are kept, and sent before its next frame*/
+void send_frame(Subscriber *subscriber, unsigned char *frame, long length)
+{
+   long sent = send(subscriber->fd, frame, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+   if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) sent = 0;
+   if(sent < 0)
+   {
+      drop_subscriber(subscriber);
+      return;
+   }
+   if(sent < length)
+   {
+      memcpy(subscriber->pending, frame + sent, length - sent);
+      subscriber->pending_length = length - sent;
+      subscriber->pending_sent = 0;
+   }
+   subscriber->synced = 1;
+}
+
+/*Sends what is left of the last message of the subscriber, without waiting. Returns 1 if nothing is left*/
+int flush_subscriber(Subscriber *subscriber)
+{
+   long sent;
+
+   if(subscriber->pending_sent == subscriber->pending_length) return 1;
+   sent = send(subscriber->fd, subscriber->pending + subscriber->pending_sent, subscriber->pending_length - subscriber->pending_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+   if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) sent = 0;
+   if(sent < 0)
+   {
+      drop_subscriber(subscriber);
+      return 0;
+   }
+   subscriber->pending_sent += sent;
+   if(subscriber->pending_sent < subscriber->pending_length) return 0;
+   subscriber->pending_length = subscriber->pending_sent = 0;
+   return 1;
+}
+
+/*Sends a whole message, waiting for the socket (up to its send timeout). Returns 1 if it was sent*/
+int send_whole(int fd, unsigned char *message, long length)
+{
+   long sent;
+
+   while(length > 0)
+   {
+      sent = send(fd, message, length, MSG_NOSIGNAL);
+      if(sent <= 0) return 0;
+      message += sent;
+      length -= sent;
+   }
+   return 1;
+}
+
+/*Disconnects a subscriber*/
+void drop_subscriber(Subscriber *subscriber)
+{
+   close(subscriber->fd);
+   free(subscriber->pending);
+   subscriber->fd = -1;
+}
+
+/*Ends the telemetry. Every subscriber gets the rest of its last frame, a keyframe if it missed the final frame, and the end of the race, 
+waiting up to TELEMETRY_LINGER seconds for each message: the race is over, so nothing waits for the subscribers anymore*/
+void end_telemetry()
+{
+   struct timeval linger;
+   unsigned char end[sizeof(uint32_t) + 1 + VARINT_BYTES];
+   long key_length = 0, end_length = encode_end(end);
+   Subscriber *subscriber;
+   int i;
+
+   linger.tv_sec = TELEMETRY_LINGER;
+   linger.tv_usec = 0;
+   for(i = 0; i < TELEMETRY_SUBSCRIBERS; i++)
+   {
+      subscriber = &telemetry.subscriber[i];
+      if(subscriber->fd < 0) continue;
+      setsockopt(subscriber->fd, SOL_SOCKET, SO_SNDTIMEO, &linger, sizeof(linger));
+      if(send_whole(subscriber->fd, subscriber->pending + subscriber->pending_sent, subscriber->pending_length - subscriber->pending_sent))
+      {
+         if(!subscriber->synced)
+         {
+            if(key_length == 0) key_length = encode_keyframe(telemetry.keyframe);
+            subscriber->synced = send_whole(subscriber->fd, telemetry.keyframe, key_length);
+         }
+         if(subscriber->synced) send_whole(subscriber->fd, end, end_length);
+      }
+      drop_subscriber(subscriber);
+   }
+   close(telemetry.listener);
+   unlink(TELEMETRY_SOCKET);
+}
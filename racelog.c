@@ -0,0 +1,136 @@
+/*Renders the text log of a race (output/race.log) from its binary log (output/race.bin)*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "eventlog.h"
+#include "rules.h"
+
+#define EXPECTED_ARGS    3
+#define EVENTS_PER_READ  4096
+
+/*Functions prototypes*/
+void render(FILE*, FILE*);
+void write_losers(FILE*, RaceEvent*, int, int);
+void write_broken(FILE*, RaceEvent*, int, int);
+void write_caught(FILE*, RaceEvent*, int, int);
+void write_winners(FILE*, RaceEvent*);
+
+int main(int argc, char **argv)
+{
+   FILE *in, *out;
+   const char *in_name = "output/race.bin", *out_name = "output/race.log";
+
+   if(argc > EXPECTED_ARGS) {
+      printf("The format entrance is [binary log [text log]].\n");
+      exit(-1);
+   }
+   if(argc > 1) in_name = argv[1];
+   if(argc > 2) out_name = argv[2];
+
+   in = fopen(in_name, "rb");
+   if(in == NULL) {
+      printf("Could not open \"%s\".\n", in_name);
+      exit(-1);
+   }
+   /*"-" writes the text log in the standard output*/
+   if(strcmp(out_name, "-") == 0) out = stdout;
+   else out = fopen(out_name, "w");
+   if(out == NULL) {
+      printf("Could not open \"%s\".\n", out_name);
+      exit(-1);
+   }
+
+   render(in, out);
+
+   fclose(in);
+   if(out != stdout) fclose(out);
+   return 0;
+}
+
+/*Reads the events and writes the text log. The losers of a lap are written once the three of them are known, like the race used to do*/
+void render(FILE *in, FILE *out)
+{
+   LogHeader header;
+   RaceEvent *events, losers[3];
+   int i, n, lap = 1, known[3] = {0, 0, 0};
+
+   if(fread(&header, sizeof(header), 1, in) != 1 || strcmp(header.magic, LOG_MAGIC) != 0) {
+      printf("Not a binary race log.\n");
+      exit(-1);
+   }
+   if(header.version != LOG_VERSION) {
+      printf("Unsupported binary race log version %d (expected %d).\n", header.version, LOG_VERSION);
+      exit(-1);
+   }
+
+   fprintf(out, "OMNIUM LOG (Mode = %c):\n\n", (char)header.mode);
+
+   events = malloc(EVENTS_PER_READ * sizeof(RaceEvent));
+   while((n = fread(events, sizeof(RaceEvent), EVENTS_PER_READ, in)) > 0)
+   {
+      for(i = 0; i < n; i++)
+      {
+         switch(events[i].type)
+         {
+            case EVENT_LOSER:
+               if(!known[events[i].slot - 1])
+               {
+                  losers[events[i].slot - 1] = events[i];
+                  known[events[i].slot - 1] = 1;
+               }
+               if(known[0] && known[1] && known[2])
+               {
+                  write_losers(out, losers, lap++, header.total_cyclists);
+                  known[0] = known[1] = known[2] = 0;
+               }
+               break;
+            case EVENT_BREAK:
+               write_broken(out, &events[i], events[i].lap, header.total_cyclists);
+               break;
+            /*In an elimination race the eliminated cyclist is the last of the losers*/
+            case EVENT_ELIMINATION:
+               if(header.rules == PURSUIT_RACE) write_caught(out, &events[i], events[i].lap, header.total_cyclists);
+               break;
+            case EVENT_WINNERS:
+               write_winners(out, &events[i]);
+               break;
+         }
+      }
+   }
+   free(events);
+}
+
+/*Writes the last 3 cyclists of a lap*/
+void write_losers(FILE *out, RaceEvent *losers, int lap, int total_cyclists)
+{
+   int eliminated_place = losers[2].place;
+
+   fprintf(out, "LOSERS OF LAP %d:\n", lap);
+   fprintf(out, "Cyclist #%d has terminated this lap in position %d of %d.\n", losers[0].cyclist, eliminated_place - 2, total_cyclists);
+   fprintf(out, "Cyclist #%d has terminated this lap in position %d of %d.\n", losers[1].cyclist, eliminated_place - 1, total_cyclists);
+   fprintf(out, "Cyclist #%d has terminated this lap in position %d of %d. -> ELIMINATED.\n", losers[2].cyclist, eliminated_place, total_cyclists);
+}
+
+/*Writes a broken cyclist*/
+void write_broken(FILE *out, RaceEvent *broken, int lap, int total_cyclists)
+{
+   fprintf(out, "KNOCKED OUT IN LAP %d:\n", lap);
+   fprintf(out, "Cyclist #%d has been knocked out. His final standing is %d of %d. -> BROKEN.\n", broken->cyclist, broken->place, total_cyclists);
+}
+
+/*Writes a cyclist caught in a pursuit*/
+void write_caught(FILE *out, RaceEvent *caught, int lap, int total_cyclists)
+{
+   fprintf(out, "CAUGHT IN LAP %d:\n", lap);
+   fprintf(out, "Cyclist #%d has been caught. His final standing is %d of %d. -> ELIMINATED.\n", caught->cyclist, caught->place, total_cyclists);
+}
+
+/*Writes the winners*/
+void write_winners(FILE *out, RaceEvent *winners)
+{
+   fputs("\n\nOMNIUM WINNERS:\n", out);
+   fprintf(out, "\n1st place: Cyclist #%d.", winners->cyclist);
+   fprintf(out, "\n2nd place: Cyclist #%d.", winners->other);
+   fprintf(out, "\n3rd place: Cyclist #%d.", winners->third);
+}
@@ -0,0 +1,187 @@
+/*Replays a trace of a race (output/race.trace): prints the state of the cyclists in a range of cycles.
+The trace is mapped in memory, so only the pages of the frames that are read are loaded. Seeking a cycle decodes its keyframe and at most KEYFRAME_EVERY-1 delta frames*/
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+#define EXPECTED_ARGS    4
+
+/*A decoded frame: the state of every cyclist in a cycle*/
+typedef struct frame {
+   long tick;                 /*Cycle of the frame*/
+   int *position;             /*Position, in units*/
+   int *lap;
+   int *place;
+} Frame;
+
+/*Functions prototypes*/
+const unsigned char *get_varint(const unsigned char*, uint32_t*);
+int unzigzag(uint32_t);
+const unsigned char *decode_frame(const unsigned char*, Frame*);
+const unsigned char *seek(long, Frame*);
+void print_frame(Frame*);
+
+/*Global variables related to the trace.
+trace is the mapped file, header its header and numbers the numbers of the cyclists. index is the offset of every keyframe*/
+const unsigned char *trace;
+TraceHeader header;
+const int32_t *numbers;
+const int64_t *keyframes;
+
+int main(int argc, char **argv)
+{
+   const char *file = "output/race.trace";
+   const unsigned char *p;
+   struct stat info;
+   long tick, count = 1, i;
+   Frame frame;
+   int fd;
+
+   if(argc > EXPECTED_ARGS) {
+      printf("The format entrance is [trace [cycle [cycles]]].\n");
+      exit(-1);
+   }
+   if(argc > 1) file = argv[1];
+
+   fd = open(file, O_RDONLY);
+   if(fd < 0 || fstat(fd, &info) != 0) {
+      printf("Could not open \"%s\".\n", file);
+      exit(-1);
+   }
+   if(info.st_size < (long)sizeof(TraceHeader)) {
+      printf("Not a race trace.\n");
+      exit(-1);
+   }
+   trace = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   if(trace == MAP_FAILED) {
+      printf("Could not map \"%s\".\n", file);
+      exit(-1);
+   }
+
+   memcpy(&header, trace, sizeof(header));
+   if(strcmp(header.magic, TRACE_MAGIC) != 0) {
+      printf("Not a race trace.\n");
+      exit(-1);
+   }
+   if(header.version != TRACE_VERSION) {
+      printf("Unsupported race trace version %d (expected %d).\n", header.version, TRACE_VERSION);
+      exit(-1);
+   }
+   if(header.frames == 0 || header.index_offset + header.keyframes * (long)sizeof(int64_t) > info.st_size) {
+      printf("The trace is incomplete: the race did not finish.\n");
+      exit(-1);
+   }
+   numbers = (const int32_t*)(trace + sizeof(TraceHeader));
+   keyframes = (const int64_t*)(trace + header.index_offset);
+
+   tick = header.first_tick;
+   if(argc > 2) tick = atol(argv[2]);
+   if(argc > 3) count = atol(argv[3]);
+   if(tick < header.first_tick || tick >= header.first_tick + header.frames) {
+      printf("The trace has the cycles %ld to %ld.\n", (long)header.first_tick, (long)(header.first_tick + header.frames - 1));
+      exit(-1);
+   }
+   if(tick + count > header.first_tick + header.frames) count = header.first_tick + header.frames - tick;
+
+   frame.position = malloc(header.total_cyclists * sizeof(int));
+   frame.lap = malloc(header.total_cyclists * sizeof(int));
+   frame.place = malloc(header.total_cyclists * sizeof(int));
+
+   printf("OMNIUM REPLAY (Mode = %c): %d cyclists, %dm track, cycles %ld to %ld.\n", (char)header.mode, header.total_cyclists, header.track_size, (long)header.first_tick, (long)(header.first_tick + header.frames - 1));
+   p = seek(tick, &frame);
+   for(i = 0; i < count; i++)
+   {
+      if(i > 0) p = decode_frame(p, &frame);
+      print_frame(&frame);
+   }
+
+   free(frame.position);
+   free(frame.lap);
+   free(frame.place);
+   munmap((void*)trace, info.st_size);
+   close(fd);
+   return 0;
+}
+
+/*Decodes the frame of the cycle tick. Returns the beginning of the next frame*/
+const unsigned char *seek(long tick, Frame *frame)
+{
+   long n = tick - header.first_tick, i;
+   const unsigned char *p = trace + keyframes[n / header.keyframe_every];
+
+   frame->tick = header.first_tick + n / header.keyframe_every * header.keyframe_every - 1;
+   for(i = 0; i <= n % header.keyframe_every; i++) p = decode_frame(p, frame);
+   return p;
+}
+
+/*Decodes a frame over the frame before it. Returns the beginning of the next frame*/
+const unsigned char *decode_frame(const unsigned char *p, Frame *frame)
+{
+   uint32_t value, changed;
+   int i, cyclist = -1;
+
+   if(*p == TRACE_KEYFRAME)
+   {
+      p++;
+      for(i = 0; i < header.total_cyclists; i++)
+      {
+         p = get_varint(p, &value); frame->position[i] = value;
+         p = get_varint(p, &value); frame->lap[i] = value;
+         p = get_varint(p, &value); frame->place[i] = value;
+      }
+   }
+   else if(*p == TRACE_DELTA)
+   {
+      p = get_varint(p + 1, &changed);
+      for(i = 0; i < (int)changed; i++)
+      {
+         p = get_varint(p, &value); cyclist += value + 1;
+         p = get_varint(p, &value); frame->position[cyclist] += unzigzag(value);
+         p = get_varint(p, &value); frame->lap[cyclist] += unzigzag(value);
+         p = get_varint(p, &value); frame->place[cyclist] += unzigzag(value);
+      }
+   }
+   else
+   {
+      printf("The trace is corrupted (cycle %ld).\n", frame->tick + 1);
+      exit(-1);
+   }
+   frame->tick++;
+   return p;
+}
+
+/*Prints the cyclists in a frame, like the race does in debug mode*/
+void print_frame(Frame *frame)
+{
+   int i;
+   printf("\nCycle %ld:\n", frame->tick);
+   for(i = 0; i < header.total_cyclists; i++)
+      printf("Cyclist #%d | Track Position:  %.1fm | Place: %d | Lap: %d\n", numbers[i], (float)frame->position[i] / header.units, frame->place[i], frame->lap[i]);
+}
+
+/*Reads a varint. Returns the byte after it*/
+const unsigned char *get_varint(const unsigned char *p, uint32_t *value)
+{
+   int shift = 0;
+   *value = 0;
+   do
+   {
+      *value |= (uint32_t)(*p & 0x7f) << shift;
+      shift += 7;
+   } while(*p++ & 0x80);
+   return p;
+}
+
+/*Decodes a zigzag encoded difference*/
+int unzigzag(uint32_t value)
+{
+   return (int)(value >> 1) ^ -(int)(value & 1);
+}
@@ -0,0 +1,64 @@
+#ifndef RULES_H
+#define RULES_H
+
+/*Rule sets of the race. The rule set is chosen when the race is compiled (-DRULES=..., see the makefile): every rule is a constant,
+so the rules that a race does not have compile to nothing and the moves of the cyclists test no rule at run time.
+- ELIMINATION_RACE (race): the last cyclist crossing the line is eliminated, until a single cyclist is left;
+- SCRATCH_RACE (race-scratch): the first cyclist to cover FINISH_LAPS laps wins, the others are placed by the distance they covered;
+- POINTS_RACE (race-points): like a scratch race, but every SPRINT_EVERY laps the first cyclists to cross the line score points,
+  and the cyclists are placed by their points (then by the distance they covered);
+- PURSUIT_RACE (race-pursuit): the cyclists start evenly spread along the track. A cyclist caught by one behind him is eliminated,
+  and the first cyclist to cover FINISH_LAPS laps (from his own start) wins*/
+
+#define ELIMINATION_RACE 1
+#define SCRATCH_RACE     2
+#define POINTS_RACE      3
+#define PURSUIT_RACE     4
+
+#ifndef RULES
+#define RULES ELIMINATION_RACE
+#endif
+
+#if RULES == ELIMINATION_RACE
+#define RULES_NAME       "elimination"
+#define ELIMINATE_LAST   1        /*Is the last cyclist crossing the line eliminated?*/
+#define ELIMINATE_CAUGHT 0        /*Is a caught cyclist eliminated?*/
+#define SPREAD_START     0        /*Do the cyclists start evenly spread along the track (instead of 1m apart)?*/
+#define FINISH_LAPS      0        /*Laps of the race (0: until a single cyclist is left)*/
+#define SPRINT_EVERY     0        /*Laps from a sprint to the next (0: no sprints)*/
+#define BREAK_EVERY      4        /*Laps from a break attempt to the next (0: no breaks)*/
+#elif RULES == SCRATCH_RACE
+#define RULES_NAME       "scratch"
+#define ELIMINATE_LAST   0
+#define ELIMINATE_CAUGHT 0
+#define SPREAD_START     0
+#define FINISH_LAPS      20
+#define SPRINT_EVERY     0
+#define BREAK_EVERY      4
+#elif RULES == POINTS_RACE
+#define RULES_NAME       "points"
+#define ELIMINATE_LAST   0
+#define ELIMINATE_CAUGHT 0
+#define SPREAD_START     0
+#define FINISH_LAPS      20
+#define SPRINT_EVERY     5
+#define BREAK_EVERY      4
+#elif RULES == PURSUIT_RACE
+#define RULES_NAME       "pursuit"
+#define ELIMINATE_LAST   0
+#define ELIMINATE_CAUGHT 1
+#define SPREAD_START     1
+#define FINISH_LAPS      16
+#define SPRINT_EVERY     0
+#define BREAK_EVERY      0
+#else
+#error "Unknown rule set (RULES must be ELIMINATION_RACE, SCRATCH_RACE, POINTS_RACE or PURSUIT_RACE)"
+#endif
+
+#define BREAK_CHANCE     100      /*A break attempt breaks the cyclist once in BREAK_CHANCE*/
+#define BREAK_IMMUNE     3        /*Cyclists immune to break attempts: no attempt is made once this many are left*/
+#define SPRINT_POINTS    {5, 3, 2, 1} /*Points of the first cyclists to cross the line in a sprint*/
+#define SPRINT_SCORERS   4        /*Cyclists that score in a sprint*/
+#define SPRINTS          (SPRINT_EVERY ? FINISH_LAPS / (SPRINT_EVERY ? SPRINT_EVERY : 1) : 0) /*Sprints in the race*/
+
+#endif
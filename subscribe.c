@@ -0,0 +1,274 @@
+/*Subscribes to the live telemetry of a race (--telemetry) and prints it: the cyclists every few cycles, and the eliminations and breaks as they happen.
+A delay after every message makes it a slow subscriber, that the race down-samples (and drops, if it can not keep up at all)*/
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "telemetry.h"
+
+#define EXPECTED_ARGS    4
+#define PRINT_EVERY      20        /*Default cycles between two printed frames*/
+#define CONNECT_TRIES    1000      /*The race may not have opened the socket yet: tries to connect, CONNECT_NAP_NSEC apart*/
+#define CONNECT_NAP_NSEC 10000000
+
+/*The state of every cyclist, as the last frame left it*/
+typedef struct state {
+   long tick;                 /*Cycle of the last frame*/
+   int *position;             /*Position, in units*/
+   int *lap;
+   int *place;
+   int *status;               /*TELEMETRY_ELIMINATED and TELEMETRY_BROKEN*/
+} State;
+
+/*Functions prototypes*/
+int connect_to(const char*);
+unsigned char *read_message(int, uint32_t*);
+int read_whole(int, void*, long);
+const unsigned char *get_varint(const unsigned char*, uint32_t*);
+int unzigzag(uint32_t);
+void decode_keyframe(const unsigned char*);
+void decode_delta(const unsigned char*);
+void change_status(int, int);
+void print_state();
+void nap(long);
+
+/*Global variables related to the stream.
+header is the header of the race and numbers the numbers of its cyclists. state is the race as the last frame left it (known once a keyframe came).
+frames counts the frames received, keyframes the keyframes among them and missed the cycles the race did not send*/
+TelemetryHeader header;
+int32_t *numbers;
+State state;
+int known;
+long frames, keyframes, missed;
+
+int main(int argc, char **argv)
+{
+   const char *path = TELEMETRY_SOCKET;
+   unsigned char *message;
+   uint32_t length;
+   long every = PRINT_EVERY, delay = 0, next_print = 0, last_tick = -1;
+   int fd;
+
+   if(argc > EXPECTED_ARGS) {
+      printf("The format entrance is [socket [cycles between frames [delay in ms after each message]]].\n");
+      exit(-1);
+   }
+   if(argc > 1) path = argv[1];
+   if(argc > 2) every = atol(argv[2]);
+   if(argc > 3) delay = atol(argv[3]);
+   if(every < 1 || delay < 0) {
+      printf("Frames must be at least 1 cycle apart, and the delay can not be negative.\n");
+      exit(-1);
+   }
+
+   fd = connect_to(path);
+   message = read_message(fd, &length);
+   if(message == NULL || message[0] != TELEMETRY_HELLO || length < 1 + sizeof(TelemetryHeader)) {
+      printf("Not a race telemetry.\n");
+      exit(-1);
+   }
+   memcpy(&header, message + 1, sizeof(header));
+   if(strcmp(header.magic, TELEMETRY_MAGIC) != 0 || header.version != TELEMETRY_VERSION) {
+      printf("Unsupported race telemetry.\n");
+      exit(-1);
+   }
+   numbers = malloc(header.total_cyclists * sizeof(int32_t));
+   memcpy(numbers, message + 1 + sizeof(header), header.total_cyclists * sizeof(int32_t));
+   free(message);
+   state.position = malloc(header.total_cyclists * sizeof(int));
+   state.lap = malloc(header.total_cyclists * sizeof(int));
+   state.place = malloc(header.total_cyclists * sizeof(int));
+   state.status = malloc(header.total_cyclists * sizeof(int));
+   printf("OMNIUM TELEMETRY (Mode = %c): %d cyclists, %dm track.\n", (char)header.mode, header.total_cyclists, header.track_size);
+
+   while(1)
+   {
+      message = read_message(fd, &length);
+      if(message == NULL) {
+         printf("\nThe race closed the telemetry before the end: this subscriber did not keep up, or the race was stopped.\n");
+         exit(-1);
+      }
+      if(message[0] == TELEMETRY_END) break;
+      if(message[0] == TELEMETRY_KEYFRAME) decode_keyframe(message + 1);
+      else if(message[0] == TELEMETRY_DELTA && known) decode_delta(message + 1);
+      else {
+         printf("The telemetry is corrupted.\n");
+         exit(-1);
+      }
+      free(message);
+
+      frames++;
+      if(last_tick >= 0 && state.tick > last_tick + 1) missed += state.tick - last_tick - 1;
+      last_tick = state.tick;
+      if(state.tick >= next_print)
+      {
+         print_state();
+         next_print = (state.tick / every + 1) * every;
+      }
+      if(delay > 0) nap(delay * 1000000);
+   }
+   free(message);
+
+   printf("\nFinal standings:");
+   print_state();
+   printf("%ld frames (%ld keyframes), %ld cycles missed.\n", frames, keyframes, missed);
+
+   close(fd);
+   free(numbers);
+   free(state.position);
+   free(state.lap);
+   free(state.place);
+   free(state.status);
+   return 0;
+}
+
+/*Connects to the telemetry socket, waiting for the race to open it. Returns the socket*/
+int connect_to(const char *path)
+{
+   struct sockaddr_un address;
+   int fd, i;
+
+   if(strlen(path) >= sizeof(address.sun_path)) {
+      printf("The socket path \"%s\" is too long.\n", path);
+      exit(-1);
+   }
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   strcpy(address.sun_path, path);
+   for(i = 0; i < CONNECT_TRIES; i++)
+   {
+      fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      if(fd < 0) break;
+      if(connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) return fd;
+      close(fd);
+      nap(CONNECT_NAP_NSEC);
+   }
+   printf("Could not connect to \"%s\".\n", path);
+   exit(-1);
+}
+
+/*Reads a message. Returns it (the type, then the body), or NULL if the race closed the socket*/
+unsigned char *read_message(int fd, uint32_t *length)
+{
+   unsigned char *message;
+
+   if(!read_whole(fd, length, sizeof(*length)) || *length == 0) return NULL;
+   message = malloc(*length);
+   if(!read_whole(fd, message, *length))
+   {
+      free(message);
+      return NULL;
+   }
+   return message;
+}
+
+/*Reads exactly size bytes. Returns 0 if the socket was closed before*/
+int read_whole(int fd, void *buffer, long size)
+{
+   char *p = buffer;
+   long n;
+
+   while(size > 0)
+   {
+      n = read(fd, p, size);
+      if(n <= 0) return 0;
+      p += n;
+      size -= n;
+   }
+   return 1;
+}
+
+/*Decodes a keyframe. Cyclists that left the race since the last frame received are reported*/
+void decode_keyframe(const unsigned char *p)
+{
+   uint32_t value;
+   int i;
+
+   p = get_varint(p, &value); state.tick = value;
+   for(i = 0; i < header.total_cyclists; i++)
+   {
+      p = get_varint(p, &value); state.position[i] = value;
+      p = get_varint(p, &value); state.lap[i] = value;
+      p = get_varint(p, &value); state.place[i] = value;
+      p = get_varint(p, &value);
+      if(known) change_status(i, value);
+      else state.status[i] = value;
+   }
+   known = 1;
+   keyframes++;
+}
+
+/*Decodes a delta frame over the state*/
+void decode_delta(const unsigned char *p)
+{
+   uint32_t value, changed;
+   int i, cyclist = -1;
+
+   p = get_varint(p, &value); state.tick = value;
+   p = get_varint(p, &changed);
+   for(i = 0; i < (int)changed; i++)
+   {
+      p = get_varint(p, &value); cyclist += value + 1;
+      p = get_varint(p, &value); state.position[cyclist] += unzigzag(value);
+      p = get_varint(p, &value); state.lap[cyclist] += unzigzag(value);
+      p = get_varint(p, &value); state.place[cyclist] += unzigzag(value);
+      p = get_varint(p, &value); change_status(cyclist, state.status[cyclist] + unzigzag(value));
+   }
+}
+
+/*Sets the status of the cyclist, reporting him if he just left the race*/
+void change_status(int cyclist, int status)
+{
+   if(status != state.status[cyclist])
+   {
+      if(status & TELEMETRY_BROKEN)
+         printf("\nCycle %ld: cyclist #%d has been knocked out. Place: %d -> BROKEN\n", state.tick, numbers[cyclist], state.place[cyclist]);
+      else if(status & TELEMETRY_ELIMINATED)
+         printf("\nCycle %ld: cyclist #%d has been eliminated. Place: %d -> ELIMINATED\n", state.tick, numbers[cyclist], state.place[cyclist]);
+   }
+   state.status[cyclist] = status;
+}
+
+/*Prints the cyclists, like the race does in debug mode*/
+void print_state()
+{
+   int i;
+   printf("\nCycle %ld:\n", state.tick);
+   for(i = 0; i < header.total_cyclists; i++)
+      printf("Cyclist #%d | Track Position:  %.1fm | Place: %d | Lap: %d%s\n", numbers[i], (float)state.position[i] / header.units, state.place[i], state.lap[i],
+         (state.status[i] & TELEMETRY_BROKEN) ? " | BROKEN" : (state.status[i] & TELEMETRY_ELIMINATED) ? " | ELIMINATED" : "");
+}
+
+/*Reads a varint. Returns the byte after it*/
+const unsigned char *get_varint(const unsigned char *p, uint32_t *value)
+{
+   int shift = 0;
+   *value = 0;
+   do
+   {
+      *value |= (uint32_t)(*p & 0x7f) << shift;
+      shift += 7;
+   } while(*p++ & 0x80);
+   return p;
+}
+
+/*Decodes a zigzag encoded difference*/
+int unzigzag(uint32_t value)
+{
+   return (int)(value >> 1) ^ -(int)(value & 1);
+}
+
+/*Sleeps nsec nanoseconds*/
+void nap(long nsec)
+{
+   struct timespec wait;
+   wait.tv_sec = nsec / 1000000000;
+   wait.tv_nsec = nsec % 1000000000;
+   nanosleep(&wait, NULL);
+}
@@ -0,0 +1,41 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/*Live telemetry of a race, streamed with --telemetry to the subscribers of a Unix domain socket (output/race.sock). subscribe reads it.
+The stream is a sequence of messages, each one a uint32_t with the length of the rest of the message, then its type:
+- TELEMETRY_HELLO, first message of every subscriber: a TelemetryHeader and the numbers of the cyclists (total_cyclists int32_t);
+- TELEMETRY_KEYFRAME: the cycle, then the position, lap, place and status of every cyclist;
+- TELEMETRY_DELTA: the cycle, the number of cyclists that changed since the frame before and, for each one, the gap from the cyclist before
+  in the frame (his index for the first one) and the differences of position, lap, place and status, zigzag encoded (like the trace, see trace.h);
+- TELEMETRY_END: the cycle. The race is over, and the frame before it has the final places.
+Numbers after the type are varints (see trace.h). Eliminations and breaks are the changes of status: a cyclist is out once TELEMETRY_ELIMINATED
+or TELEMETRY_BROKEN is set, and his place is then his final standing.
+The race never waits for a subscriber. A subscriber that can not take a frame misses it and the ones after it, until it can take a whole
+frame again: that one is a keyframe. A subscriber that misses TELEMETRY_PATIENCE frames in a row is dropped.
+The lengths and the header are in the byte order of the machine that runs the race*/
+
+#include <stdint.h>
+
+#define TELEMETRY_SOCKET     "output/race.sock" /*Path of the socket*/
+#define TELEMETRY_MAGIC      "RACETLM"          /*Magic string of the header*/
+#define TELEMETRY_VERSION    1
+#define TELEMETRY_HELLO      'H'
+#define TELEMETRY_KEYFRAME   'K'
+#define TELEMETRY_DELTA      'D'
+#define TELEMETRY_END        'E'
+#define TELEMETRY_ELIMINATED 0x1  /*Status bit: the cyclist was eliminated*/
+#define TELEMETRY_BROKEN     0x2  /*Status bit: the cyclist broke*/
+#define TELEMETRY_PATIENCE   256  /*Frames in a row a subscriber may miss before it is dropped*/
+
+/*Header of the stream, in the TELEMETRY_HELLO message*/
+typedef struct telemetry_header {
+   char magic[8];                    /*TELEMETRY_MAGIC*/
+   int32_t version;                  /*TELEMETRY_VERSION*/
+   int32_t mode;                     /*Simulation mode (u, v, U or V)*/
+   int32_t total_cyclists;           /*Number of cyclists at the start of the race*/
+   int32_t track_size;               /*Size of the track, in meters*/
+   int32_t units;                    /*Units of a position in a meter*/
+   int32_t rules;                    /*Rule set of the race (see rules.h)*/
+} TelemetryHeader;
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*Per cycle trace of a race (output/race.trace), written with --trace. replay reads it. The file is:
+- a TraceHeader;
+- the numbers of the cyclists (total_cyclists int32_t);
+- one frame per cycle, from first_tick to first_tick+frames-1. Every keyframe_every-th frame is a keyframe, with the state of every cyclist.
+  The others are delta frames, with the cyclists that changed since the frame before;
+- the index: the offset in the file of every keyframe (keyframes int64_t), at index_offset.
+Numbers in the frames are varints: 7 bits per byte, least significant first, with the high bit set when more bytes follow.
+A keyframe is TRACE_KEYFRAME, then the position, lap and place of every cyclist.
+A delta frame is TRACE_DELTA, the number of cyclists that changed and, for each one, the gap from the cyclist before in the frame (his index for the first one)
+and the differences of position, lap and place, zigzag encoded (0, -1, 1, -2... are 0, 1, 2, 3...).
+Positions are in units (units in a meter). The header, numbers and index are in the byte order of the machine that ran the race*/
+
+#include <stdint.h>
+
+#define TRACE_MAGIC      "RACETRC"   /*Magic string at the beginning of a trace*/
+#define TRACE_VERSION    2
+#define TRACE_KEYFRAME   'K'
+#define TRACE_DELTA      'D'
+
+/*Header of a trace*/
+typedef struct trace_header {
+   char magic[8];                    /*TRACE_MAGIC*/
+   int32_t version;                  /*TRACE_VERSION*/
+   int32_t mode;                     /*Simulation mode (u, v, U or V)*/
+   int32_t total_cyclists;           /*Number of cyclists at the start of the race*/
+   int32_t track_size;               /*Size of the track, in meters*/
+   int32_t keyframe_every;           /*Frames from a keyframe to the next*/
+   int32_t units;                    /*Units of a position in a meter*/
+   int64_t first_tick;               /*Cycle of the first frame (not 0 for a resumed race)*/
+   int64_t frames;                   /*Number of frames. 0 until the race is over*/
+   int64_t keyframes;                /*Number of keyframes*/
+   int64_t index_offset;             /*Offset of the index in the file*/
+} TraceHeader;
+
+#endif